@@ -1,57 +1,406 @@
 #define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
-#include <ctype.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// error messages go through report: to stderr normally, or into the calling
+// thread's capture buffer while batch mode runs a program, so the message can
+// become that program's result line. only the first message is kept
+#define REPORT_MAX 512
+static _Thread_local char *report_buf;
+
+void report(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    if (report_buf) {
+        if (!report_buf[0]) {
+            vsnprintf(report_buf, REPORT_MAX, fmt, ap);
+            report_buf[strcspn(report_buf, "\n")] = '\0';
+        }
+    } else {
+        fputs("SHEQ: ", stderr);
+        vfprintf(stderr, fmt, ap);
+    }
+    va_end(ap);
+}
+
+// arena memory comes in linked chunks; a full chunk links a new one in front
+typedef struct ArenaChunk {
+    struct ArenaChunk *prev;
+    size_t cap;
+    size_t used;
+    size_t mapped;          // nonzero if chunk came from mmap (size to munmap)
+    unsigned char data[];
+} ArenaChunk;
+
+enum {
+    ARENA_MMAP = 1,         // back chunks with anonymous mmap instead of malloc
+    ARENA_HUGE = 2          // ask for 2MB huge pages (implies ARENA_MMAP)
+};
+
+// what an allocation is for; --stats breaks an arena's bytes down by it
+enum {
+    ALLOC_ENV,              // call frames
+    ALLOC_CLOSURE,
+    ALLOC_STRING,           // headers, text and rope nodes
+    ALLOC_AST,              // literals optimize folds into new Strings
+    ALLOC_CODE,             // --vm protos, bytecode and constants
+    ALLOC_NAME,             // interned identifiers
+    ALLOC_KINDS
+};
+
+// --stats: totals for one arena; counted only when Arena.stats is set
+typedef struct {
+    size_t bytes[ALLOC_KINDS], count[ALLOC_KINDS];
+    size_t live;            // handed out and not rewound, padding included
+    size_t high_water;      // most live at once
+    size_t padding;         // skipped to align allocations
+    size_t chunk_tails;     // left unused at the end of a chunk when the next was linked
+    size_t chunks;          // created; spares put back in use are not counted again
+    size_t chunk_bytes;     // capacity of the chunks created
+} ArenaStats;
 
 typedef struct Arena {
-    unsigned char *buf;
-    size_t buf_len;
-    size_t curr_offset;
+    ArenaChunk *head;       // chunk currently being bumped
+    ArenaChunk *spare;      // chunks released by arena_rewind, reused before new ones
+    size_t chunk_size;
+    int flags;
+    size_t allocated;       // bytes handed out since creation, rewinds included; for --profile
+    ArenaStats *stats;      // --stats: where to count; NULL otherwise
 } Arena;
 
+// checkpoint for arena_rewind: everything allocated after it can be dropped
+typedef struct {
+    ArenaChunk *chunk;
+    size_t used;
+} ArenaMark;
+
+#define ARENA_ALIGN 8
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
 size_t align_up(size_t size, size_t align) {
     return ((size + align - 1) / align) * align;
 }
 
-// size bytes from arena, 8-byte aligned, zeroed; NULL on exhaustion
-void *arena_alloc(Arena *arena, size_t size) {
-    size_t aligned_offset = align_up(arena->curr_offset, 8);
-    if (aligned_offset + size > arena->buf_len) {
-        fprintf(stderr, "SHEQ: arena exhausted\n");
-        return NULL;
+ArenaChunk *chunk_create(size_t cap, int flags) {
+    size_t total = sizeof(ArenaChunk) + cap;
+    ArenaChunk *chunk = NULL;
+    size_t mapped = 0;
+
+    if (flags & (ARENA_MMAP | ARENA_HUGE)) {
+        void *mem = MAP_FAILED;
+#ifdef MAP_HUGETLB
+        if (flags & ARENA_HUGE) {
+            mapped = align_up(total, HUGE_PAGE_SIZE);
+            mem = mmap(NULL, mapped, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        }
+#endif
+        // no reserved huge pages: fall back to normal pages, hint THP
+        if (mem == MAP_FAILED) {
+            mapped = total;
+            mem = mmap(NULL, mapped, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#ifdef MADV_HUGEPAGE
+            if (mem != MAP_FAILED && (flags & ARENA_HUGE))
+                madvise(mem, mapped, MADV_HUGEPAGE);
+#endif
+        }
+        if (mem == MAP_FAILED) {
+            report("mmap failed\n");
+            return NULL;
+        }
+        chunk = mem;
+        // huge page rounding may leave usable slack at the end
+        cap = mapped - sizeof(ArenaChunk);
+    } else {
+        chunk = malloc(total);
+        if (!chunk) {
+            report("malloc failed\n");
+            return NULL;
+        }
+    }
+    chunk->prev = NULL;
+    chunk->cap = cap;
+    chunk->used = 0;
+    chunk->mapped = mapped;
+    return chunk;
+}
+
+void chunk_destroy(ArenaChunk *chunk) {
+    if (chunk->mapped) munmap(chunk, chunk->mapped);
+    else free(chunk);
+}
+
+// link a fresh chunk with room for size bytes in front of head
+ArenaChunk *arena_grow(Arena *arena, size_t size) {
+    ArenaChunk *chunk;
+    if (arena->spare && arena->spare->cap >= size) {
+        chunk = arena->spare;
+        arena->spare = chunk->prev;
+        chunk->used = 0;
+    } else {
+        // oversized requests get a dedicated chunk of exactly their size
+        chunk = chunk_create(size > arena->chunk_size ? size : arena->chunk_size, arena->flags);
+        if (!chunk) return NULL;
+        if (arena->stats) {
+            arena->stats->chunks++;
+            arena->stats->chunk_bytes += chunk->cap;
+        }
+    }
+    if (arena->stats) arena->stats->chunk_tails += arena->head->cap - arena->head->used;
+    chunk->prev = arena->head;
+    arena->head = chunk;
+    return chunk;
+}
+
+// --stats: an allocation of size bytes at offset in chunk, before chunk->used moves past it
+void arena_count(ArenaStats *stats, ArenaChunk *chunk, size_t offset, size_t size, int kind) {
+    stats->bytes[kind] += size;
+    stats->count[kind]++;
+    stats->padding += offset - chunk->used;
+    stats->live += offset - chunk->used + size;
+    if (stats->live > stats->high_water) stats->high_water = stats->live;
+}
+
+// size bytes from arena for kind, 8-byte aligned, not zeroed; NULL if the OS is out of memory
+static inline void *arena_alloc_raw(Arena *arena, size_t size, int kind) {
+    ArenaChunk *chunk = arena->head;
+    size_t aligned_offset = align_up(chunk->used, ARENA_ALIGN);
+    if (aligned_offset + size > chunk->cap) {
+        chunk = arena_grow(arena, size);
+        if (!chunk) {
+            report("arena exhausted\n");
+            return NULL;
+        }
+        aligned_offset = 0;
     }
-    void *ptr = &arena->buf[aligned_offset];
-    arena->curr_offset = aligned_offset + size;
-    memset(ptr, 0, size);
+    if (arena->stats) arena_count(arena->stats, chunk, aligned_offset, size, kind);
+    chunk->used = aligned_offset + size;
+    arena->allocated += size;
+    return &chunk->data[aligned_offset];
+}
+
+// size bytes from arena, 8-byte aligned, zeroed; NULL on exhaustion
+void *arena_alloc(Arena *arena, size_t size, int kind) {
+    void *ptr = arena_alloc_raw(arena, size, kind);
+    if (ptr) memset(ptr, 0, size);
     return ptr;
 }
 
-Arena *arena_create(size_t capacity) {
+ArenaMark arena_mark(Arena *arena) {
+    return (ArenaMark){arena->head, arena->head->used};
+}
+
+// true if ptr points into memory handed out after mark
+int arena_since(Arena *arena, ArenaMark mark, const void *ptr) {
+    const unsigned char *p = ptr;
+    for (ArenaChunk *chunk = arena->head; chunk; chunk = chunk->prev) {
+        size_t from = chunk == mark.chunk ? mark.used : 0;
+        if (p >= chunk->data + from && p < chunk->data + chunk->used) return 1;
+        if (chunk == mark.chunk) return 0;
+    }
+    return 0;
+}
+
+// bytes currently handed out, across all chunks
+size_t arena_size(Arena *arena) {
+    size_t size = 0;
+    for (ArenaChunk *chunk = arena->head; chunk; chunk = chunk->prev) size += chunk->used;
+    return size;
+}
+
+// drop everything allocated since mark; freed chunks are kept as spares
+void arena_rewind(Arena *arena, ArenaMark mark) {
+    while (arena->head != mark.chunk) {
+        ArenaChunk *chunk = arena->head;
+        arena->head = chunk->prev;
+        if (arena->stats) arena->stats->live -= chunk->used;
+        if (chunk->cap > arena->chunk_size) {
+            chunk_destroy(chunk);
+        } else {
+            chunk->prev = arena->spare;
+            arena->spare = chunk;
+        }
+    }
+    if (arena->stats) arena->stats->live -= arena->head->used - mark.used;
+    arena->head->used = mark.used;
+}
+
+// chunk_size is the size of each linked block; the arena grows past it on demand
+Arena *arena_create(size_t chunk_size, int flags) {
     Arena *arena = malloc(sizeof(Arena));
     if (!arena) {
-        fprintf(stderr, "SHEQ: malloc failed\n");
+        report("malloc failed\n");
         return NULL;
     }
-    arena->buf = malloc(capacity);
-    if (!arena->buf) {
-        fprintf(stderr, "SHEQ: malloc failed\n");
+    if (flags & ARENA_HUGE) chunk_size = align_up(chunk_size, HUGE_PAGE_SIZE) - sizeof(ArenaChunk);
+    arena->chunk_size = chunk_size;
+    arena->flags = flags;
+    arena->spare = NULL;
+    arena->allocated = 0;
+    arena->stats = NULL;
+    arena->head = chunk_create(chunk_size, flags);
+    if (!arena->head) {
         free(arena);
         return NULL;
     }
-    arena->buf_len = capacity;
-    arena->curr_offset = 0;
     return arena;
 }
 
+void chunk_list_destroy(ArenaChunk *chunk) {
+    while (chunk) {
+        ArenaChunk *prev = chunk->prev;
+        chunk_destroy(chunk);
+        chunk = prev;
+    }
+}
+
+// --stats: count arena's allocations into stats from now on. what it already
+// holds counts as live, untagged
+void arena_track(Arena *arena, ArenaStats *stats) {
+    arena->stats = stats;
+    for (ArenaChunk *chunk = arena->head; chunk; chunk = chunk->prev) {
+        stats->chunks++;
+        stats->chunk_bytes += chunk->cap;
+        stats->live += chunk->used;
+    }
+    for (ArenaChunk *chunk = arena->spare; chunk; chunk = chunk->prev) {
+        stats->chunks++;
+        stats->chunk_bytes += chunk->cap;
+    }
+    if (stats->live > stats->high_water) stats->high_water = stats->live;
+}
+
 void arena_destroy(Arena *arena) {
     if (arena) {
-        free(arena->buf);
+        chunk_list_destroy(arena->head);
+        chunk_list_destroy(arena->spare);
         free(arena);
     }
 }
 
+typedef struct {
+    char *name;             // NULL marks an empty slot
+    size_t len;
+    size_t hash;
+} Symbol;
+
+// open-addressing intern table; every distinct identifier is stored once,
+// so names compare by pointer everywhere after lexing
+typedef struct {
+    Symbol *slots;          // capacity is a power of two, kept under 3/4 full
+    size_t cap;
+    size_t count;
+    Arena *strings;         // owns the interned text, separate from program memory
+} SymTab;
+
+SymTab *symtab_create(void) {
+    SymTab *st = malloc(sizeof(SymTab));
+    if (!st) {
+        report("malloc failed\n");
+        return NULL;
+    }
+    st->cap = 256;
+    st->count = 0;
+    st->slots = calloc(st->cap, sizeof(Symbol));
+    st->strings = arena_create(64 * 1024, 0);
+    if (!st->slots || !st->strings) {
+        report("malloc failed\n");
+        free(st->slots);
+        arena_destroy(st->strings);
+        free(st);
+        return NULL;
+    }
+    return st;
+}
+
+void symtab_destroy(SymTab *st) {
+    if (st) {
+        free(st->slots);
+        arena_destroy(st->strings);
+        free(st);
+    }
+}
+
+// FNV-1a
+#define HASH_BASIS 14695981039346656037ULL
+
+// FNV-1a over len more bytes, continuing from hash
+size_t hash_more(size_t hash, const char *str, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)str[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+size_t hash_bytes(const char *str, size_t len) {
+    return hash_more(HASH_BASIS, str, len);
+}
+
+size_t hash_ptr(const void *ptr) {
+    uintptr_t x = (uintptr_t)ptr >> 3;
+    return (size_t)(x * 0x9E3779B97F4A7C15ull);
+}
+
+int symtab_grow(SymTab *st) {
+    size_t cap = st->cap * 2;
+    Symbol *slots = calloc(cap, sizeof(Symbol));
+    if (!slots) {
+        report("malloc failed\n");
+        return 0;
+    }
+    for (size_t i = 0; i < st->cap; i++) {
+        if (!st->slots[i].name) continue;
+        size_t j = st->slots[i].hash & (cap - 1);
+        while (slots[j].name) j = (j + 1) & (cap - 1);
+        slots[j] = st->slots[i];
+    }
+    free(st->slots);
+    st->slots = slots;
+    st->cap = cap;
+    return 1;
+}
+
+// canonical NUL-terminated copy of str[0..len); NULL on allocation failure
+char *intern(SymTab *st, const char *str, size_t len) {
+    size_t hash = hash_bytes(str, len);
+    size_t i = hash & (st->cap - 1);
+    // linear probing
+    for (; st->slots[i].name; i = (i + 1) & (st->cap - 1)) {
+        Symbol *sym = &st->slots[i];
+        if (sym->hash == hash && sym->len == len && memcmp(sym->name, str, len) == 0)
+            return sym->name;
+    }
+
+    char *name = arena_alloc_raw(st->strings, len + 1, ALLOC_NAME);
+    if (!name) return NULL;
+    memcpy(name, str, len);
+    name[len] = '\0';
+    st->slots[i] = (Symbol){name, len, hash};
+    st->count++;
+    if (st->count * 4 >= st->cap * 3 && !symtab_grow(st)) return NULL;
+    return name;
+}
+
 typedef enum {
     TOK_ERROR = 0,
     TOK_NUMBER,
@@ -75,19 +424,28 @@ typedef enum {
     TOK_EOF
 } TokenType;
 
+// a slice of the source; nothing is copied while lexing
 typedef struct {
     TokenType type;
-    char *text;
+    const char *start;      // len bytes, not NUL-terminated
+    int len;
     int line;
     int col;
+    union {
+        double num;         // TOK_NUMBER: value, parsed while lexing
+        char *name;         // TOK_ID, TOK_TRUE, TOK_FALSE: interned text
+    } as;
 } Token;
 
+// cursor over the source; the parser pulls one token at a time from it
 typedef struct {
-    Token *tokens;
-    int count;
-    int capacity;
-    int current;
-} TokenStream;
+    const char *input;
+    int pos;
+    int len;
+    int line;
+    int line_start;         // offset of the current line's first byte; col = pos - line_start + 1
+    SymTab *st;             // identifier text is interned here
+} Lexer;
 
 typedef enum {
     NODE_NUMC,
@@ -95,33 +453,123 @@ typedef enum {
     NODE_IDC,
     NODE_IFC,
     NODE_LAMC,
-    NODE_APPC
+    NODE_APPC,
+    // produced by optimize, never by the parser
+    NODE_BOOLC,             // folded boolean, or an unshadowed true/false
+    NODE_PRIMC              // application of an unshadowed primitive
 } NodeType;
 
+// primitives optimize can inline; order matches prim_ops
+typedef enum {
+    PRIM_ADD,
+    PRIM_SUB,
+    PRIM_MUL,
+    PRIM_DIV,
+    PRIM_LTE,
+    PRIM_EQUAL,
+    PRIM_SUBSTRING,
+    PRIM_STRLEN,
+    PRIM_APPEND,
+    PRIM_COUNT
+} PrimOp;
+
+// flat text, or a rope node joining two strings. flat data may be a view into
+// a longer string's buffer, so it isn't NUL-terminated. rope nodes keep AVL
+// balance, so depth stays logarithmic in the number of pieces
+typedef struct String {
+    size_t len;
+    int depth;              // 0 for flat text; else 1 + the deeper half's
+    union {
+        char *data;
+        struct {
+            struct String *left, *right;
+        };
+    };
+} String;
+
+// where a resolved identifier lives at runtime
+typedef enum {
+    VAR_LOCAL,              // param of the innermost lambda: a slot of the current frame
+    VAR_CAPTURED,           // free variable: a slot of the running closure's captures
+    VAR_GLOBAL              // top-level binding
+} VarKind;
+
+typedef struct {
+    VarKind kind;
+    int slot;
+} VarRef;
+
+// nodes refer to each other by index into Ast.nodes
+typedef uint32_t NodeId;
+
+#define NO_NODE UINT32_MAX      // parse failure
+
+// a lambda's params and free variables, kept out of its node
+typedef struct {
+    int param_count;
+    int params;             // first name in Ast.names
+    // free variables, as seen from the enclosing frame; filled in by resolve
+    int capture_count;
+    int captures;           // first VarRef in Ast.refs
+    int line, col;          // of the lambda or let keyword; --profile names lambdas by it
+} LamInfo;
+
+// 16 bytes: a tag and three 32-bit fields. literals, names and child lists
+// live in the Ast's side arrays, so a program's nodes are one contiguous array
 typedef struct ASTNode {
-    NodeType type;
+    uint8_t type;           // NodeType
+    uint8_t op;             // PrimOp of a PrimC
     union {
-        double num_val;
-        char *str_val;
-        char *var;
+        uint32_t num;           // index into Ast.nums
+        uint32_t str;           // index into Ast.strs
+        int bool_val;
+        struct {
+            VarRef ref;         // filled in by resolve
+            uint32_t name;      // index into Ast.names
+        } id_node;
         struct {
-            struct ASTNode *test;
-            struct ASTNode *then_expr;
-            struct ASTNode *else_expr;
+            NodeId test;
+            NodeId then_expr;
+            NodeId else_expr;
         } if_node;
         struct {
-            int param_count;
-            char **params;
-            struct ASTNode *body;
+            NodeId body;
+            uint32_t info;      // index into Ast.lams
         } lam_node;
         struct {
-            int child_count;
-            struct ASTNode **children;
+            uint32_t children;  // first of child_count in Ast.kids: function, then args
+            uint32_t child_count;
+            uint32_t fork_mask; // args worth forking (bit i: arg i); see mark_forks
         } app_node;
+        struct {
+            uint32_t args;      // first of arg_count in Ast.kids
+            uint32_t arg_count;
+            uint32_t fork_mask; // bit i: arg i
+        } prim_node;
     } as;
 } ASTNode;
 
+// a parsed program: its nodes plus the side arrays they index. a batch
+// context keeps one and resets it per program, so the buffers only grow
+typedef struct {
+    ASTNode *nodes;
+    int n_nodes, nodes_cap;
+    NodeId *kids;           // child lists of AppC and PrimC nodes
+    int n_kids, kids_cap;
+    double *nums;
+    int n_nums, nums_cap;
+    String *strs;           // literal text is read in place from the source
+    int n_strs, strs_cap;
+    char **names;           // interned; IdC names and lambda params
+    int n_names, names_cap;
+    LamInfo *lams;
+    int n_lams, lams_cap;
+    VarRef *refs;           // capture lists of lambdas
+    int n_refs, refs_cap;
+} Ast;
+
 typedef enum {
+    VAL_ERROR = 0,          // returned in place of a value after a runtime error
     VAL_NUMV,
     VAL_STRV,
     VAL_BOOLV,
@@ -132,538 +580,1031 @@ typedef enum {
 typedef struct Env Env;
 typedef struct Value Value;
 
-typedef Value *(*PrimFn)(Value *args, int n_args, Arena *arena);
+typedef Value (*PrimFn)(Value *args, int n_args, Arena *arena);
+
+typedef struct Closure Closure;
 
+// 16 bytes, passed and returned by value. numbers, booleans and primitives
+// are immediates; only strings and closures point at arena objects
 struct Value {
     ValueType type;
     union {
         double num;
-        struct {
-            char *data;
-            size_t len;
-        } str;
         int boolval;
-        struct {
-            int param_count;
-            char **params;
-            ASTNode *body;
-            Env *env;
-        } clos;
         PrimFn prim;
+        String *str;
+        Closure *clos;
     } as;
 };
 
-typedef struct Binding {
-    char *name;
-    Value val;
-    struct Binding *next;
-} Binding;
-
-struct Env {
-    Binding *bindings;
-    Env *parent;
+// flat closure: copies of just the free variables the body uses, in the
+// order of its LamInfo's captures, so no enclosing frame is kept alive
+struct Closure {
+    int param_count;
+    int capture_count;
+    ASTNode *body;          // in the running program's Ast.nodes
+    struct Proto *proto;    // compiled body when running under --vm
+    Value captures[];
 };
 
-Env *create_env(Arena *arena, Env *parent) {
-    Env *env = arena_alloc(arena, sizeof(Env));
-    if (!env) return NULL;
-    env->bindings = NULL;
-    env->parent = parent;
-    return env;
-}
+static inline Value numv(double num) { return (Value){VAL_NUMV, {.num = num}}; }
+static inline Value boolv(int b) { return (Value){VAL_BOOLV, {.boolval = b}}; }
+static inline Value errv(void) { return (Value){VAL_ERROR, {.num = 0}}; }
 
-// walk env chain for name binding; NULL if unbound
-Value *lookup(Env *env, const char *name) {
-    for (; env; env = env->parent) {
-        for (Binding *binding = env->bindings; binding; binding = binding->next) {
-            if (strcmp(binding->name, name) == 0)
-                return &binding->val;
-        }
-    }
-    return NULL;
+// string value over len bytes at data (not copied); VAL_ERROR on exhaustion
+Value strv(Arena *arena, char *data, size_t len) {
+    String *str = arena_alloc_raw(arena, sizeof(String), ALLOC_STRING);
+    if (!str) return errv();
+    str->len = len;
+    str->depth = 0;
+    str->data = data;
+    return (Value){VAL_STRV, {.str = str}};
 }
 
-// add name->val binding to env; returns success
-int bind_env(Arena *arena, Env *env, const char *name, Value val) {
-    Binding *binding = arena_alloc(arena, sizeof(Binding));
-    if (!binding) return 0;
-    size_t len = strlen(name);
-    binding->name = arena_alloc(arena, len + 1);
-    if (!binding->name) return 0;
-    memcpy(binding->name, name, len + 1);
-    binding->val = val;
-    binding->next = env->bindings;
-    env->bindings = binding;
-    return 1;
+// flat pieces shorter than this are copied together rather than joined
+#define ROPE_LEAF 64
+// deepest a balanced rope over 2^64 bytes can get, with room to spare
+#define ROPE_DEPTH_MAX 128
+
+// walks a string's flat pieces left to right
+typedef struct {
+    const String *stack[ROPE_DEPTH_MAX];
+    int top;
+} StrCursor;
+
+static inline void cursor_init(StrCursor *cur, const String *str) {
+    cur->stack[0] = str;
+    cur->top = 1;
 }
 
-// new env with count bindings; parent chain provides outer scope
-Env *extend_env(Arena *arena, Env *parent, int count, char **names, Value *vals) {
-    Env *env = create_env(arena, parent);
-    if (!env) return NULL;
-    // reverse order so first param ends up at head of binding list
-    for (int i = count - 1; i >= 0; i--) {
-        Binding *binding = arena_alloc(arena, sizeof(Binding));
-        if (!binding) return NULL;
-        size_t len = strlen(names[i]);
-        binding->name = arena_alloc(arena, len + 1);
-        if (!binding->name) return NULL;
-        memcpy(binding->name, names[i], len + 1);
-        binding->val = vals[i];
-        binding->next = env->bindings;
-        env->bindings = binding;
+// next non-empty flat piece, or NULL at the end
+static const String *cursor_next(StrCursor *cur) {
+    while (cur->top > 0) {
+        const String *str = cur->stack[--cur->top];
+        if (str->depth == 0) {
+            if (str->len) return str;
+            continue;
+        }
+        cur->stack[cur->top++] = str->right;
+        cur->stack[cur->top++] = str->left;
     }
-    return env;
+    return NULL;
 }
 
-ASTNode *make_num(Arena *arena, double val) {
-    ASTNode *node = arena_alloc(arena, sizeof(ASTNode));
-    if (!node) return NULL;
-    node->type = NODE_NUMC;
-    node->as.num_val = val;
-    return node;
+// copy str's text to dst (str->len bytes, no terminator)
+void string_write(char *dst, const String *str) {
+    if (str->depth == 0) {
+        memcpy(dst, str->data, str->len);
+        return;
+    }
+    StrCursor cur;
+    cursor_init(&cur, str);
+    for (const String *piece; (piece = cursor_next(&cur)); dst += piece->len)
+        memcpy(dst, piece->data, piece->len);
 }
 
-ASTNode *make_str(Arena *arena, const char *str, size_t len) {
-    ASTNode *node = arena_alloc(arena, sizeof(ASTNode));
-    if (!node) return NULL;
-    node->type = NODE_STRC;
-    node->as.str_val = arena_alloc(arena, len + 1);
-    if (!node->as.str_val) return NULL;
-    memcpy(node->as.str_val, str, len);
-    node->as.str_val[len] = '\0';
-    return node;
+// str as one flat string in arena, NUL-terminated
+String *string_flatten(Arena *arena, const String *str) {
+    char *data = arena_alloc_raw(arena, str->len + 1, ALLOC_STRING);
+    if (!data) return NULL;
+    string_write(data, str);
+    data[str->len] = '\0';
+    Value val = strv(arena, data, str->len);
+    return val.type == VAL_STRV ? val.as.str : NULL;
 }
 
-ASTNode *make_id(Arena *arena, const char *name) {
-    ASTNode *node = arena_alloc(arena, sizeof(ASTNode));
-    if (!node) return NULL;
-    node->type = NODE_IDC;
-    size_t len = strlen(name);
-    node->as.var = arena_alloc(arena, len + 1);
-    if (!node->as.var) return NULL;
-    memcpy(node->as.var, name, len + 1);
-    return node;
+static String *rope_node(Arena *arena, String *left, String *right) {
+    String *str = arena_alloc_raw(arena, sizeof(String), ALLOC_STRING);
+    if (!str) return NULL;
+    str->len = left->len + right->len;
+    str->depth = 1 + (left->depth > right->depth ? left->depth : right->depth);
+    str->left = left;
+    str->right = right;
+    return str;
 }
 
-ASTNode *make_if(Arena *arena, ASTNode *test, ASTNode *then_expr, ASTNode *else_expr) {
-    ASTNode *node = arena_alloc(arena, sizeof(ASTNode));
-    if (!node) return NULL;
-    node->type = NODE_IFC;
-    node->as.if_node.test = test;
-    node->as.if_node.then_expr = then_expr;
-    node->as.if_node.else_expr = else_expr;
-    return node;
+// AVL join: descend the deeper side until the heights meet, then rotate on
+// the way back up. allocates O(depth) new nodes and never touches old ones
+static String *rope_join(Arena *arena, String *left, String *right) {
+    if (left->depth > right->depth + 1) {
+        String *joined = rope_join(arena, left->right, right);
+        if (!joined) return NULL;
+        String *outer = left->left;
+        if (joined->depth <= outer->depth + 1) return rope_node(arena, outer, joined);
+        if (joined->right->depth >= joined->left->depth) {
+            String *inner = rope_node(arena, outer, joined->left);
+            return inner ? rope_node(arena, inner, joined->right) : NULL;
+        }
+        String *a = rope_node(arena, outer, joined->left->left);
+        String *b = rope_node(arena, joined->left->right, joined->right);
+        return a && b ? rope_node(arena, a, b) : NULL;
+    }
+    if (right->depth > left->depth + 1) {
+        String *joined = rope_join(arena, left, right->left);
+        if (!joined) return NULL;
+        String *outer = right->right;
+        if (joined->depth <= outer->depth + 1) return rope_node(arena, joined, outer);
+        if (joined->left->depth >= joined->right->depth) {
+            String *inner = rope_node(arena, joined->right, outer);
+            return inner ? rope_node(arena, joined->left, inner) : NULL;
+        }
+        String *a = rope_node(arena, joined->left, joined->right->left);
+        String *b = rope_node(arena, joined->right->right, outer);
+        return a && b ? rope_node(arena, a, b) : NULL;
+    }
+    return rope_node(arena, left, right);
 }
 
-ASTNode *make_lambda(Arena *arena, int n_params, char **params, ASTNode *body) {
-    ASTNode *node = arena_alloc(arena, sizeof(ASTNode));
-    if (!node) return NULL;
-    node->type = NODE_LAMC;
-    node->as.lam_node.param_count = n_params;
-    node->as.lam_node.params = arena_alloc(arena, sizeof(char *) * n_params);
-    if (!node->as.lam_node.params && n_params > 0) return NULL;
-    for (int i = 0; i < n_params; i++) {
-        size_t len = strlen(params[i]);
-        node->as.lam_node.params[i] = arena_alloc(arena, len + 1);
-        if (!node->as.lam_node.params[i]) return NULL;
-        memcpy(node->as.lam_node.params[i], params[i], len + 1);
-    }
-    node->as.lam_node.body = body;
-    return node;
+// left followed by right. short pieces are copied into one flat string, so
+// appending a character at a time doesn't build a node per character
+String *string_concat(Arena *arena, String *left, String *right) {
+    if (left->len == 0) return right;
+    if (right->len == 0) return left;
+    size_t len = left->len + right->len;
+    if (len <= ROPE_LEAF) {
+        char *data = arena_alloc_raw(arena, len, ALLOC_STRING);
+        if (!data) return NULL;
+        string_write(data, left);
+        string_write(data + left->len, right);
+        Value val = strv(arena, data, len);
+        return val.type == VAL_STRV ? val.as.str : NULL;
+    }
+    if (right->len < ROPE_LEAF && left->depth > 0 && left->right->len + right->len <= ROPE_LEAF) {
+        String *tail = string_concat(arena, left->right, right);
+        return tail ? rope_join(arena, left->left, tail) : NULL;
+    }
+    return rope_join(arena, left, right);
 }
 
-ASTNode *make_app(Arena *arena, ASTNode *func, int n_args, ASTNode **args) {
-    ASTNode *node = arena_alloc(arena, sizeof(ASTNode));
-    if (!node) return NULL;
-    node->type = NODE_APPC;
-    // children[0] = function, children[1..n] = arguments
-    node->as.app_node.child_count = n_args + 1;
-    node->as.app_node.children = arena_alloc(arena, sizeof(ASTNode *) * (n_args + 1));
-    if (!node->as.app_node.children) return NULL;
-    node->as.app_node.children[0] = func;
-    for (int i = 0; i < n_args; i++)
-        node->as.app_node.children[i + 1] = args[i];
-    return node;
+// bytes [start, stop) of str. flat text gives a view sharing str's buffer; a
+// rope gives the pieces in range joined, so nothing is copied either way
+String *string_sub(Arena *arena, String *str, size_t start, size_t stop) {
+    if (start == 0 && stop == str->len) return str;
+    if (str->depth == 0) {
+        Value val = strv(arena, str->data + start, stop - start);
+        return val.type == VAL_STRV ? val.as.str : NULL;
+    }
+    size_t split = str->left->len;
+    if (stop <= split) return string_sub(arena, str->left, start, stop);
+    if (start >= split) return string_sub(arena, str->right, start - split, stop - split);
+    String *left = string_sub(arena, str->left, start, split);
+    String *right = string_sub(arena, str->right, 0, stop - split);
+    return left && right ? string_concat(arena, left, right) : NULL;
 }
 
-// input string -> token stream; NULL on lexical error
-TokenStream *tokenize(Arena *arena, const char *input) {
-    TokenStream *ts = arena_alloc(arena, sizeof(TokenStream));
-    if (!ts) return NULL;
-
-    // 64 covers most expressions; grows as needed
-    ts->capacity = 64;
-    ts->tokens = arena_alloc(arena, sizeof(Token) * ts->capacity);
-    if (!ts->tokens) return NULL;
-    ts->count = 0;
-    ts->current = 0;
-
-    int pos = 0;
-    int len = strlen(input);
-    int line = 1, col = 1;
-
-    while (pos < len) {
-        while (pos < len && isspace(input[pos])) {
-            if (input[pos] == '\n') { line++; col = 1; }
-            else col++;
-            pos++;
-        }
-        if (pos >= len) break;
-
-        Token tok = {0};
-        tok.line = line;
-        tok.col = col;
-
-        if (isdigit(input[pos]) || (input[pos] == '-' && pos + 1 < len && isdigit(input[pos + 1]))) {
-            int start = pos;
-            if (input[pos] == '-') pos++;
-            while (pos < len && isdigit(input[pos])) pos++;
-            if (pos < len && input[pos] == '.') {
-                pos++;
-                while (pos < len && isdigit(input[pos])) pos++;
-            }
-            int num_len = pos - start;
-            tok.type = TOK_NUMBER;
-            tok.text = arena_alloc(arena, num_len + 1);
-            if (!tok.text) return NULL;
-            memcpy(tok.text, input + start, num_len);
-            tok.text[num_len] = '\0';
-            col += num_len;
-        }
-        else if (input[pos] == '"') {
-            int start = pos++;
-            while (pos < len && input[pos] != '"') {
-                if (input[pos] == '\\' && pos + 1 < len) pos++;
-                pos++;
-            }
-            if (pos >= len) {
-                fprintf(stderr, "SHEQ: unterminated string at line %d col %d\n", line, col);
-                return NULL;
-            }
-            pos++;
-            int str_len = pos - start;
-            tok.type = TOK_STRING;
-            tok.text = arena_alloc(arena, str_len + 1);
-            if (!tok.text) return NULL;
-            memcpy(tok.text, input + start, str_len);
-            tok.text[str_len] = '\0';
-            col += str_len;
-        }
-        else if (input[pos] == '{') { tok.type = TOK_LBRACE; tok.text = "{"; pos++; col++; }
-        else if (input[pos] == '}') { tok.type = TOK_RBRACE; tok.text = "}"; pos++; col++; }
-        else if (input[pos] == '(') { tok.type = TOK_LPAREN; tok.text = "("; pos++; col++; }
-        else if (input[pos] == ')') { tok.type = TOK_RPAREN; tok.text = ")"; pos++; col++; }
-        else if (input[pos] == '[') { tok.type = TOK_LBRACKET; tok.text = "["; pos++; col++; }
-        else if (input[pos] == ']') { tok.type = TOK_RBRACKET; tok.text = "]"; pos++; col++; }
-        else if (input[pos] == ':') { tok.type = TOK_COLON; tok.text = ":"; pos++; col++; }
-        else if (input[pos] == '=') { tok.type = TOK_EQUALS; tok.text = "="; pos++; col++; }
-        // operators (+, -, *, etc.) are valid identifiers in SHEQ4
-        // minus is tricky: `-5` is negative number, `-` alone or `-foo` is identifier
-        else if (isalpha(input[pos]) || input[pos] == '_' ||
-                 input[pos] == '+' || input[pos] == '*' ||
-                 input[pos] == '/' || input[pos] == '<' ||
-                 input[pos] == '>' || input[pos] == '?' || input[pos] == '!' ||
-                 (input[pos] == '-' && (pos + 1 >= len || !isdigit(input[pos + 1])))) {
-            int start = pos;
-            while (pos < len && (isalnum(input[pos]) || input[pos] == '_' ||
-                   input[pos] == '-' || input[pos] == '?' || input[pos] == '!' ||
-                   input[pos] == '+' || input[pos] == '*' || input[pos] == '/' ||
-                   input[pos] == '<' || input[pos] == '=' || input[pos] == '>'))
-                pos++;
-            int id_len = pos - start;
-            tok.text = arena_alloc(arena, id_len + 1);
-            if (!tok.text) return NULL;
-            memcpy(tok.text, input + start, id_len);
-            tok.text[id_len] = '\0';
-
-            if (strcmp(tok.text, "if") == 0) tok.type = TOK_IF;
-            else if (strcmp(tok.text, "lambda") == 0) tok.type = TOK_LAMBDA;
-            else if (strcmp(tok.text, "let") == 0) tok.type = TOK_LET;
-            else if (strcmp(tok.text, "in") == 0) tok.type = TOK_IN;
-            else if (strcmp(tok.text, "end") == 0) tok.type = TOK_END;
-            else if (strcmp(tok.text, "true") == 0) tok.type = TOK_TRUE;
-            else if (strcmp(tok.text, "false") == 0) tok.type = TOK_FALSE;
-            else tok.type = TOK_ID;
-
-            col += id_len;
-        }
-        else {
-            fprintf(stderr, "SHEQ: unexpected '%c' at line %d col %d\n", input[pos], line, col);
-            return NULL;
-        }
+// one frame per call: header plus the argument values, in one allocation.
+// slot i holds param i; names live only in the resolver's Scope. closures copy
+// what they need out of it, so a frame never outlives its call
+struct Env {
+    Closure *clos;          // closure being run; NULL for the top level and primitives
+    int count;
+    Value slots[];
+};
 
-        if (ts->count >= ts->capacity) {
-            ts->capacity *= 2;
-            Token *newtoks = arena_alloc(arena, sizeof(Token) * ts->capacity);
-            if (!newtoks) return NULL;
-            memcpy(newtoks, ts->tokens, sizeof(Token) * ts->count);
-            ts->tokens = newtoks;
-        }
-        ts->tokens[ts->count++] = tok;
-    }
+// frame with count uninitialized slots
+Env *alloc_env(Arena *arena, Closure *clos, int count) {
+    Env *env = arena_alloc_raw(arena, sizeof(Env) + sizeof(Value) * count, ALLOC_ENV);
+    if (!env) return NULL;
+    env->clos = clos;
+    env->count = count;
+    return env;
+}
 
-    Token eof = {TOK_EOF, NULL, line, col};
-    ts->tokens[ts->count++] = eof;
-    return ts;
+Closure *alloc_closure(Arena *arena, int capture_count) {
+    return arena_alloc_raw(arena, sizeof(Closure) + sizeof(Value) * capture_count, ALLOC_CLOSURE);
 }
 
+typedef struct TaskPool TaskPool;
+typedef struct Memo Memo;
+typedef struct Profile Profile;
+
+// state shared by every interp call in one evaluation
 typedef struct {
-    TokenStream *ts;
+    const Ast *ast;         // the program; nodes index its side arrays
     Arena *arena;
-} Parser;
+    Value *globals;         // slots of the top-level env
+    TaskPool *tasks;        // --parallel: where forked args go; NULL otherwise
+    Memo *memo;             // --memo: results of earlier closure calls; NULL otherwise
+    Profile *prof;          // --profile: counters and the call stack; NULL otherwise
+    int call_body;          // the next interp call runs a memoized or profiled call's body
+} Interp;
 
-Token peek(Parser *parser) {
-    return parser->ts->tokens[parser->ts->current];
-}
-
-Token advance(Parser *parser) {
-    if (parser->ts->current < parser->ts->count - 1)
-        parser->ts->current++;
-    return parser->ts->tokens[parser->ts->current - 1];
-}
-
-int match(Parser *parser, TokenType type) {
-    if (peek(parser).type == type) {
-        advance(parser);
-        return 1;
+// value at a resolved address
+static inline Value lookup(Interp *in, Env *env, VarRef ref) {
+    switch (ref.kind) {
+        case VAR_LOCAL:    return env->slots[ref.slot];
+        case VAR_CAPTURED: return env->clos->captures[ref.slot];
+        default:           return in->globals[ref.slot];
     }
-    return 0;
 }
 
-Token expect(Parser *parser, TokenType type, const char *msg) {
-    Token tok = peek(parser);
-    if (tok.type != type) {
-        fprintf(stderr, "SHEQ: %s at line %d col %d\n", msg, tok.line, tok.col);
-        return (Token){TOK_ERROR, NULL, tok.line, tok.col};
+int grow_buf(void **buf, int *cap, int need, size_t elem) {
+    if (need <= *cap) return 1;
+    // doubling past INT_MAX would overflow; the last step stops at it
+    int cap2 = *cap ? *cap : 16;
+    while (cap2 < need) cap2 = cap2 > INT_MAX / 2 ? INT_MAX : cap2 * 2;
+    void *grown = realloc(*buf, elem * cap2);
+    if (!grown) {
+        report("malloc failed\n");
+        return 0;
     }
-    return advance(parser);
+    *buf = grown;
+    *cap = cap2;
+    return 1;
 }
 
-ASTNode *parse_expr(Parser *parser);
+void *arena_dup(Arena *arena, const void *src, size_t size, int kind) {
+    void *dst = arena_alloc_raw(arena, size, kind);
+    if (dst && size) memcpy(dst, src, size);
+    return dst;
+}
 
-ASTNode *parse_lambda(Parser *parser) {
-    expect(parser, TOK_LPAREN, "lambda needs '('");
+void ast_reset(Ast *ast) {
+    ast->n_nodes = ast->n_kids = ast->n_nums = ast->n_strs = 0;
+    ast->n_names = ast->n_lams = ast->n_refs = 0;
+}
 
-    // most lambdas have <8 params; grows if needed
-    int cap = 8;
-    int count = 0;
-    char **params = arena_alloc(parser->arena, sizeof(char *) * cap);
-    if (!params) return NULL;
+// bytes the nodes and side arrays take; literal text stays in the source
+size_t ast_bytes(const Ast *ast) {
+    return sizeof(ASTNode) * ast->n_nodes + sizeof(NodeId) * ast->n_kids
+        + sizeof(double) * ast->n_nums + sizeof(String) * ast->n_strs
+        + sizeof(char *) * ast->n_names + sizeof(LamInfo) * ast->n_lams
+        + sizeof(VarRef) * ast->n_refs;
+}
 
-    while (!match(parser, TOK_RPAREN)) {
-        if (count >= cap) {
-            cap *= 2;
-            char **new_params = arena_alloc(parser->arena, sizeof(char *) * cap);
-            if (!new_params) return NULL;
-            memcpy(new_params, params, count * sizeof(char *));
-            params = new_params;
-        }
-        Token param = expect(parser, TOK_ID, "expected param name");
-        if (param.type == TOK_ERROR) return NULL;
+void ast_free(Ast *ast) {
+    free(ast->nodes);
+    free(ast->kids);
+    free(ast->nums);
+    free(ast->strs);
+    free(ast->names);
+    free(ast->lams);
+    free(ast->refs);
+}
 
-        Token next = peek(parser);
-        if (next.type == TOK_IF || next.type == TOK_LAMBDA || next.type == TOK_LET) {
-            fprintf(stderr, "SHEQ: keyword cannot be param name\n");
-            return NULL;
-        }
+// a new node of type at the end of ast->nodes; NO_NODE on allocation failure
+NodeId add_node(Ast *ast, NodeType type) {
+    if (!grow_buf((void **)&ast->nodes, &ast->nodes_cap, ast->n_nodes + 1, sizeof(ASTNode)))
+        return NO_NODE;
+    ASTNode *node = &ast->nodes[ast->n_nodes];
+    node->type = type;
+    node->op = 0;
+    return (NodeId)ast->n_nodes++;
+}
 
-        for (int i = 0; i < count; i++) {
-            if (strcmp(params[i], param.text) == 0) {
-                fprintf(stderr, "SHEQ: duplicate param '%s'\n", param.text);
-                return NULL;
-            }
-        }
-        params[count++] = param.text;
-    }
+// index of val appended to ast->nums, or -1
+int add_num(Ast *ast, double val) {
+    if (!grow_buf((void **)&ast->nums, &ast->nums_cap, ast->n_nums + 1, sizeof(double))) return -1;
+    ast->nums[ast->n_nums] = val;
+    return ast->n_nums++;
+}
 
-    expect(parser, TOK_COLON, "lambda needs ':'");
-    ASTNode *body = parse_expr(parser);
-    if (!body) return NULL;
-    return make_lambda(parser->arena, count, params, body);
+int add_str(Ast *ast, String str) {
+    if (!grow_buf((void **)&ast->strs, &ast->strs_cap, ast->n_strs + 1, sizeof(String))) return -1;
+    ast->strs[ast->n_strs] = str;
+    return ast->n_strs++;
 }
 
-ASTNode *parse_app(Parser *parser, ASTNode *func) {
-    int cap = 8;
-    int count = 0;
-    ASTNode **args = arena_alloc(parser->arena, sizeof(ASTNode *) * cap);
-    if (!args) return NULL;
+NodeId make_num(Ast *ast, double val) {
+    int k = add_num(ast, val);
+    NodeId id = k < 0 ? NO_NODE : add_node(ast, NODE_NUMC);
+    if (id != NO_NODE) ast->nodes[id].as.num = k;
+    return id;
+}
 
-    while (peek(parser).type != TOK_RBRACE) {
-        if (count >= cap) {
-            cap *= 2;
-            ASTNode **new_args = arena_alloc(parser->arena, sizeof(ASTNode *) * cap);
-            if (!new_args) return NULL;
-            memcpy(new_args, args, count * sizeof(ASTNode *));
-            args = new_args;
-        }
-        args[count] = parse_expr(parser);
-        if (!args[count]) return NULL;
-        count++;
-    }
-    return make_app(parser->arena, func, count, args);
+// str stays in the source text; it must outlive the program's evaluation
+NodeId make_str(Ast *ast, const char *str, size_t len) {
+    // strings are never written through, so the source can be read-only
+    String lit = {len, 0, {.data = (char *)str}};
+    int k = add_str(ast, lit);
+    NodeId id = k < 0 ? NO_NODE : add_node(ast, NODE_STRC);
+    if (id != NO_NODE) ast->nodes[id].as.str = k;
+    return id;
 }
 
-ASTNode *parse_if(Parser *parser) {
-    ASTNode *test = parse_expr(parser);
-    if (!test) return NULL;
-    ASTNode *then_expr = parse_expr(parser);
-    if (!then_expr) return NULL;
-    ASTNode *else_expr = parse_expr(parser);
-    if (!else_expr) return NULL;
-    return make_if(parser->arena, test, then_expr, else_expr);
+// name must be interned
+NodeId make_id(Ast *ast, char *name) {
+    if (!grow_buf((void **)&ast->names, &ast->names_cap, ast->n_names + 1, sizeof(char *)))
+        return NO_NODE;
+    NodeId id = add_node(ast, NODE_IDC);
+    if (id == NO_NODE) return NO_NODE;
+    ast->names[ast->n_names] = name;
+    ast->nodes[id].as.id_node.name = ast->n_names++;
+    return id;
 }
 
-// desugars to ((lambda (names...) body) vals...)
-ASTNode *parse_let(Parser *parser) {
-    expect(parser, TOK_LBRACE, "let needs '{'");
+NodeId make_if(Ast *ast, NodeId test, NodeId then_expr, NodeId else_expr) {
+    NodeId id = add_node(ast, NODE_IFC);
+    if (id == NO_NODE) return NO_NODE;
+    ASTNode *node = &ast->nodes[id];
+    node->as.if_node.test = test;
+    node->as.if_node.then_expr = then_expr;
+    node->as.if_node.else_expr = else_expr;
+    return id;
+}
 
-    int cap = 8;
-    int count = 0;
-    char **names = arena_alloc(parser->arena, sizeof(char *) * cap);
-    ASTNode **vals = arena_alloc(parser->arena, sizeof(ASTNode *) * cap);
-    if (!names || !vals) return NULL;
+NodeId make_lambda(Ast *ast, int n_params, char **params, NodeId body, int line, int col) {
+    if (!grow_buf((void **)&ast->names, &ast->names_cap, ast->n_names + n_params, sizeof(char *))
+        || !grow_buf((void **)&ast->lams, &ast->lams_cap, ast->n_lams + 1, sizeof(LamInfo)))
+        return NO_NODE;
+    NodeId id = add_node(ast, NODE_LAMC);
+    if (id == NO_NODE) return NO_NODE;
+    // param names are interned; only the pointers are copied
+    memcpy(ast->names + ast->n_names, params, sizeof(char *) * n_params);
+    ast->lams[ast->n_lams] = (LamInfo){n_params, ast->n_names, 0, 0, line, col};
+    ast->n_names += n_params;
+    ast->nodes[id].as.lam_node.body = body;
+    ast->nodes[id].as.lam_node.info = ast->n_lams++;
+    return id;
+}
 
-    while (match(parser, TOK_LBRACKET)) {
-        if (count >= cap) {
-            cap *= 2;
-            char **new_names = arena_alloc(parser->arena, sizeof(char *) * cap);
-            ASTNode **new_vals = arena_alloc(parser->arena, sizeof(ASTNode *) * cap);
-            if (!new_names || !new_vals) return NULL;
-            memcpy(new_names, names, count * sizeof(char *));
-            memcpy(new_vals, vals, count * sizeof(ASTNode *));
-            names = new_names;
-            vals = new_vals;
-        }
+NodeId make_app(Ast *ast, NodeId func, int n_args, const NodeId *args) {
+    if (!grow_buf((void **)&ast->kids, &ast->kids_cap, ast->n_kids + n_args + 1, sizeof(NodeId)))
+        return NO_NODE;
+    NodeId id = add_node(ast, NODE_APPC);
+    if (id == NO_NODE) return NO_NODE;
+    // kids[0] = function, kids[1..n] = arguments
+    NodeId *kids = ast->kids + ast->n_kids;
+    kids[0] = func;
+    memcpy(kids + 1, args, sizeof(NodeId) * n_args);
+    ast->nodes[id].as.app_node.children = ast->n_kids;
+    ast->nodes[id].as.app_node.child_count = n_args + 1;
+    ast->n_kids += n_args + 1;
+    return id;
+}
 
-        Token name = expect(parser, TOK_ID, "expected binding name");
-        if (name.type == TOK_ERROR) return NULL;
+// lexer character classes, one table lookup per byte instead of ctype calls
+enum {
+    CC_SPACE = 1,
+    CC_DIGIT = 2,
+    CC_ID_START = 4,        // can begin an identifier ('-' also can, unless a digit follows)
+    CC_ID = 8,              // can continue one
+    CC_STR_STOP = 16        // ends a run of plain string bytes: '"' or '\\'
+};
 
-        Token next = peek(parser);
-        if (next.type == TOK_IF || next.type == TOK_LAMBDA || next.type == TOK_LET) {
-            fprintf(stderr, "SHEQ: keyword cannot be binding name\n");
-            return NULL;
-        }
+#define CC_LETTER(c) [c] = CC_ID_START | CC_ID
+#define CC_NUM(c) [c] = CC_DIGIT | CC_ID
 
-        for (int i = 0; i < count; i++) {
-            if (strcmp(names[i], name.text) == 0) {
-                fprintf(stderr, "SHEQ: duplicate binding '%s'\n", name.text);
-                return NULL;
-            }
-        }
-        names[count] = name.text;
+static const unsigned char char_class[256] = {
+    [' '] = CC_SPACE, ['\t'] = CC_SPACE, ['\n'] = CC_SPACE,
+    ['\v'] = CC_SPACE, ['\f'] = CC_SPACE, ['\r'] = CC_SPACE,
+    CC_NUM('0'), CC_NUM('1'), CC_NUM('2'), CC_NUM('3'), CC_NUM('4'),
+    CC_NUM('5'), CC_NUM('6'), CC_NUM('7'), CC_NUM('8'), CC_NUM('9'),
+    CC_LETTER('a'), CC_LETTER('b'), CC_LETTER('c'), CC_LETTER('d'), CC_LETTER('e'),
+    CC_LETTER('f'), CC_LETTER('g'), CC_LETTER('h'), CC_LETTER('i'), CC_LETTER('j'),
+    CC_LETTER('k'), CC_LETTER('l'), CC_LETTER('m'), CC_LETTER('n'), CC_LETTER('o'),
+    CC_LETTER('p'), CC_LETTER('q'), CC_LETTER('r'), CC_LETTER('s'), CC_LETTER('t'),
+    CC_LETTER('u'), CC_LETTER('v'), CC_LETTER('w'), CC_LETTER('x'), CC_LETTER('y'),
+    CC_LETTER('z'),
+    CC_LETTER('A'), CC_LETTER('B'), CC_LETTER('C'), CC_LETTER('D'), CC_LETTER('E'),
+    CC_LETTER('F'), CC_LETTER('G'), CC_LETTER('H'), CC_LETTER('I'), CC_LETTER('J'),
+    CC_LETTER('K'), CC_LETTER('L'), CC_LETTER('M'), CC_LETTER('N'), CC_LETTER('O'),
+    CC_LETTER('P'), CC_LETTER('Q'), CC_LETTER('R'), CC_LETTER('S'), CC_LETTER('T'),
+    CC_LETTER('U'), CC_LETTER('V'), CC_LETTER('W'), CC_LETTER('X'), CC_LETTER('Y'),
+    CC_LETTER('Z'),
+    // operators (+, -, *, etc.) are valid identifiers in SHEQ4
+    CC_LETTER('_'), CC_LETTER('+'), CC_LETTER('*'), CC_LETTER('/'), CC_LETTER('<'),
+    CC_LETTER('>'), CC_LETTER('?'), CC_LETTER('!'),
+    ['-'] = CC_ID, ['='] = CC_ID,
+    ['"'] = CC_STR_STOP, ['\\'] = CC_STR_STOP
+};
 
-        expect(parser, TOK_EQUALS, "binding needs '='");
-        vals[count] = parse_expr(parser);
-        if (!vals[count]) return NULL;
-        count++;
+#undef CC_LETTER
+#undef CC_NUM
 
-        expect(parser, TOK_RBRACKET, "binding needs ']'");
-    }
+static inline int char_is(const char *input, int pos, int cls) {
+    return char_class[(unsigned char)input[pos]] & cls;
+}
 
-    expect(parser, TOK_RBRACE, "let needs '}'");
-    expect(parser, TOK_IN, "let needs 'in'");
-    ASTNode *body = parse_expr(parser);
-    if (!body) return NULL;
-    expect(parser, TOK_END, "let needs 'end'");
+// the run loops below look at 16 bytes per step where SSE2 is available.
+// -DSHEQ_NO_SIMD forces the table-only loops
+#if defined(__SSE2__) && defined(__GNUC__) && !defined(SHEQ_NO_SIMD)
+#define LEX_SIMD 1
+#include <emmintrin.h>
 
-    ASTNode *lam = make_lambda(parser->arena, count, names, body);
-    if (!lam) return NULL;
-    return make_app(parser->arena, lam, count, vals);
+// bit i set where byte i of v is in [lo, hi]; bytes >= 0x80 are negative and never match
+static inline unsigned simd_range(__m128i v, char lo, char hi) {
+    __m128i ge = _mm_cmpgt_epi8(v, _mm_set1_epi8((char)(lo - 1)));
+    __m128i le = _mm_cmplt_epi8(v, _mm_set1_epi8((char)(hi + 1)));
+    return (unsigned)_mm_movemask_epi8(_mm_and_si128(ge, le));
 }
 
-ASTNode *parse_braced(Parser *parser) {
-    expect(parser, TOK_LBRACE, "expected '{'");
-    Token tok = peek(parser);
-    ASTNode *node;
+static inline unsigned simd_eq(__m128i v, char c) {
+    return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c)));
+}
 
-    if (tok.type == TOK_IF) {
-        advance(parser);
-        node = parse_if(parser);
+// bit i set where byte i is in class cls (CC_SPACE, CC_DIGIT, CC_ID or CC_STR_STOP);
+// mirrors char_class
+static inline unsigned simd_class(__m128i v, int cls) {
+    switch (cls) {
+        case CC_SPACE:
+            return simd_eq(v, ' ') | simd_range(v, '\t', '\r');
+        case CC_DIGIT:
+            return simd_range(v, '0', '9');
+        case CC_ID:
+            return simd_range(_mm_or_si128(v, _mm_set1_epi8(0x20)), 'a', 'z')
+                | simd_range(v, '0', '9')
+                | simd_range(v, '<', '?')           // < = > ?
+                | simd_eq(v, '_') | simd_eq(v, '-') | simd_eq(v, '!')
+                | simd_eq(v, '+') | simd_eq(v, '*') | simd_eq(v, '/');
+        default:
+            return simd_eq(v, '"') | simd_eq(v, '\\');
     }
-    else if (tok.type == TOK_LAMBDA) {
-        advance(parser);
-        node = parse_lambda(parser);
+}
+#endif
+
+// first position at or after pos whose byte is (want = 1) or isn't (want = 0) in cls
+static inline int scan_run(const char *input, int pos, int len, int cls, int want) {
+#ifdef LEX_SIMD
+    while (pos + 16 <= len) {
+        unsigned in = simd_class(_mm_loadu_si128((const __m128i *)(input + pos)), cls);
+        unsigned stop = (want ? in : ~in) & 0xFFFF;
+        if (stop) return pos + __builtin_ctz(stop);
+        pos += 16;
     }
-    else if (tok.type == TOK_LET) {
-        advance(parser);
-        node = parse_let(parser);
+#endif
+    while (pos < len && (char_is(input, pos, cls) != 0) != want) pos++;
+    return pos;
+}
+
+// skip whitespace, keeping line and line_start (offset of the line's first byte) current
+static inline int skip_space(const char *input, int pos, int len, int *line, int *line_start) {
+#ifdef LEX_SIMD
+    while (pos + 16 <= len) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(input + pos));
+        unsigned stop = ~simd_class(v, CC_SPACE) & 0xFFFF;
+        int n = stop ? __builtin_ctz(stop) : 16;
+        // newlines among the n skipped bytes: count them, and the last one starts the line
+        unsigned nl = simd_eq(v, '\n') & ((1u << n) - 1);
+        if (nl) {
+            *line += __builtin_popcount(nl);
+            *line_start = pos + 32 - __builtin_clz(nl);
+        }
+        pos += n;
+        if (stop) return pos;
     }
-    else {
-        ASTNode *func = parse_expr(parser);
-        if (!func) return NULL;
-        node = parse_app(parser, func);
+#endif
+    while (pos < len && char_is(input, pos, CC_SPACE)) {
+        if (input[pos] == '\n') {
+            (*line)++;
+            *line_start = pos + 1;
+        }
+        pos++;
     }
+    return pos;
+}
 
-    if (!node) return NULL;
-    expect(parser, TOK_RBRACE, "expected '}'");
-    return node;
+// input need not be NUL-terminated; the lexer never reads past len
+Lexer lexer_init(SymTab *st, const char *input, int len) {
+    return (Lexer){input, 0, len, 1, 0, st};
 }
 
-// token stream -> ExprC (AST node); NULL on syntax error
-ASTNode *parse_expr(Parser *parser) {
-    Token tok = peek(parser);
+// keyword type for an identifier slice, or TOK_ID; length first so most
+// identifiers are rejected without touching memory
+TokenType keyword_type(const char *text, int len) {
+    switch (len) {
+        case 2:
+            if (memcmp(text, "if", 2) == 0) return TOK_IF;
+            if (memcmp(text, "in", 2) == 0) return TOK_IN;
+            break;
+        case 3:
+            if (memcmp(text, "let", 3) == 0) return TOK_LET;
+            if (memcmp(text, "end", 3) == 0) return TOK_END;
+            break;
+        case 4:
+            if (memcmp(text, "true", 4) == 0) return TOK_TRUE;
+            break;
+        case 5:
+            if (memcmp(text, "false", 5) == 0) return TOK_FALSE;
+            break;
+        case 6:
+            if (memcmp(text, "lambda", 6) == 0) return TOK_LAMBDA;
+            break;
+    }
+    return TOK_ID;
+}
+
+// value of a number slice (-?digits(.digits)?). with at most 15 digits the
+// digits form an exact integer and 10^frac is exact too, so one division is
+// correctly rounded, same as strtod; longer literals go through a stack copy
+double lex_number(const char *text, int len) {
+    static const double pow10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15
+    };
+    int neg = text[0] == '-';
+    int dot = 0, frac = 0;
+    if (len - neg <= 16) {
+        double mant = 0;
+        for (int i = neg; i < len; i++) {
+            if (text[i] == '.') dot = 1;
+            else {
+                mant = mant * 10 + (text[i] - '0');
+                frac += dot;
+            }
+        }
+        if (len - neg - dot <= 15) {
+            double val = mant / pow10[frac];
+            return neg ? -val : val;
+        }
+    }
+    char buf[64];
+    if (len < (int)sizeof(buf)) {
+        memcpy(buf, text, len);
+        buf[len] = '\0';
+        return strtod(buf, NULL);
+    }
+    // absurdly long literal: rare enough to pay for a heap copy
+    char *copy = malloc(len + 1);
+    if (!copy) return 0.0;
+    memcpy(copy, text, len);
+    copy[len] = '\0';
+    double val = strtod(copy, NULL);
+    free(copy);
+    return val;
+}
+
+// next token from the cursor; TOK_EOF at the end, TOK_ERROR (already reported)
+// on a lexical error or allocation failure
+Token next_token(Lexer *lex) {
+    const char *input = lex->input;
+    int len = lex->len;
+    int pos = skip_space(input, lex->pos, len, &lex->line, &lex->line_start);
+    int line = lex->line, col = pos - lex->line_start + 1;
+
+    Token tok = {0};
+    tok.start = input + pos;
+    tok.line = line;
+    tok.col = col;
+    Token err = {TOK_ERROR, input + pos, 0, line, col, {0}};
+
+    if (pos >= len) {
+        tok.type = TOK_EOF;
+    }
+    else if (char_is(input, pos, CC_DIGIT) || (input[pos] == '-' && pos + 1 < len && char_is(input, pos + 1, CC_DIGIT))) {
+        int start = pos;
+        if (input[pos] == '-') pos++;
+        pos = scan_run(input, pos, len, CC_DIGIT, 0);
+        if (pos < len && input[pos] == '.') pos = scan_run(input, pos + 1, len, CC_DIGIT, 0);
+        tok.type = TOK_NUMBER;
+        tok.as.num = lex_number(input + start, pos - start);
+    }
+    else if (input[pos] == '"') {
+        pos++;
+        for (;;) {
+            pos = scan_run(input, pos, len, CC_STR_STOP, 1);
+            if (pos >= len || input[pos] == '"') break;
+            // backslash: skip it and the byte it escapes
+            pos += pos + 1 < len ? 2 : 1;
+        }
+        if (pos >= len) {
+            report("unterminated string at line %d col %d\n", line, col);
+            return err;
+        }
+        pos++;
+        tok.type = TOK_STRING;
+    }
+    else if (input[pos] == '{') { tok.type = TOK_LBRACE; pos++; }
+    else if (input[pos] == '}') { tok.type = TOK_RBRACE; pos++; }
+    else if (input[pos] == '(') { tok.type = TOK_LPAREN; pos++; }
+    else if (input[pos] == ')') { tok.type = TOK_RPAREN; pos++; }
+    else if (input[pos] == '[') { tok.type = TOK_LBRACKET; pos++; }
+    else if (input[pos] == ']') { tok.type = TOK_RBRACKET; pos++; }
+    else if (input[pos] == ':') { tok.type = TOK_COLON; pos++; }
+    else if (input[pos] == '=') { tok.type = TOK_EQUALS; pos++; }
+    // minus is tricky: `-5` is negative number, `-` alone or `-foo` is identifier
+    // (the number branch above already took the digit case)
+    else if (char_is(input, pos, CC_ID_START) || input[pos] == '-') {
+        int start = pos;
+        pos = scan_run(input, pos + 1, len, CC_ID, 0);
+        tok.type = keyword_type(input + start, pos - start);
+        // names the parser keeps (ids, and true/false which resolve like ids) are
+        // interned; that only allocates the first time a name is seen
+        if (tok.type == TOK_ID || tok.type == TOK_TRUE || tok.type == TOK_FALSE) {
+            tok.as.name = intern(lex->st, input + start, pos - start);
+            if (!tok.as.name) return err;
+        }
+    }
+    else {
+        report("unexpected '%c' at line %d col %d\n", input[pos], line, col);
+        return err;
+    }
+
+    tok.len = pos - (int)(tok.start - input);
+    lex->pos = pos;
+    return tok;
+}
+
+// pulls tokens from the lexer on demand; one token of lookahead is all the grammar needs
+typedef struct {
+    Lexer lex;
+    Token cur;              // next token to consume
+    Ast *ast;
+    // args and let values parsed so far, and let and lambda names; each
+    // construct pushes its own on top and pops them once its node is built
+    NodeId *pending;
+    int n_pending, pending_cap;
+    char **binds;
+    int n_binds, binds_cap;
+    size_t tokens;          // consumed so far, for --stats
+} Parser;
+
+Parser parser_init(Ast *ast, SymTab *st, const char *src, int len) {
+    Parser parser = {lexer_init(st, src, len), {0}, ast, NULL, 0, 0, NULL, 0, 0, 0};
+    parser.cur = next_token(&parser.lex);
+    return parser;
+}
+
+void parser_free(Parser *parser) {
+    free(parser->pending);
+    free(parser->binds);
+}
+
+int push_pending(Parser *parser, NodeId id) {
+    if (!grow_buf((void **)&parser->pending, &parser->pending_cap, parser->n_pending + 1, sizeof(NodeId)))
+        return 0;
+    parser->pending[parser->n_pending++] = id;
+    return 1;
+}
+
+// name onto the binds stack, unless it repeats one pushed since base
+int push_bind(Parser *parser, int base, char *name, const char *what) {
+    for (int i = base; i < parser->n_binds; i++) {
+        if (parser->binds[i] == name) {
+            report("duplicate %s '%s'\n", what, name);
+            return 0;
+        }
+    }
+    if (!grow_buf((void **)&parser->binds, &parser->binds_cap, parser->n_binds + 1, sizeof(char *)))
+        return 0;
+    parser->binds[parser->n_binds++] = name;
+    return 1;
+}
+
+Token peek(Parser *parser) {
+    return parser->cur;
+}
+
+// consume the current token; EOF and errors stick so the lexer isn't run past them
+Token advance(Parser *parser) {
+    Token tok = parser->cur;
+    if (tok.type != TOK_EOF && tok.type != TOK_ERROR) {
+        parser->cur = next_token(&parser->lex);
+        parser->tokens++;
+    }
+    return tok;
+}
+
+// after the top-level expression: lex the rest so lexical errors anywhere are
+// still reported, without keeping any of it
+int parser_finish(Parser *parser) {
+    while (parser->cur.type != TOK_EOF) {
+        if (parser->cur.type == TOK_ERROR) return 0;
+        advance(parser);
+    }
+    return 1;
+}
+
+int match(Parser *parser, TokenType type) {
+    if (peek(parser).type == type) {
+        advance(parser);
+        return 1;
+    }
+    return 0;
+}
+
+Token expect(Parser *parser, TokenType type, const char *msg) {
+    Token tok = peek(parser);
+    if (tok.type != type) {
+        // a TOK_ERROR was already reported by the lexer
+        if (tok.type != TOK_ERROR)
+            report("%s at line %d col %d\n", msg, tok.line, tok.col);
+        tok.type = TOK_ERROR;
+        return tok;
+    }
+    return advance(parser);
+}
+
+NodeId parse_expr(Parser *parser);
+
+// kw is the lambda keyword, for the LamInfo's position
+NodeId parse_lambda(Parser *parser, Token kw) {
+    expect(parser, TOK_LPAREN, "lambda needs '('");
+
+    int base = parser->n_binds;
+    while (!match(parser, TOK_RPAREN)) {
+        Token param = expect(parser, TOK_ID, "expected param name");
+        if (param.type == TOK_ERROR) return NO_NODE;
+
+        Token next = peek(parser);
+        if (next.type == TOK_IF || next.type == TOK_LAMBDA || next.type == TOK_LET) {
+            report("keyword cannot be param name\n");
+            return NO_NODE;
+        }
+        if (!push_bind(parser, base, param.as.name, "param")) return NO_NODE;
+    }
+
+    expect(parser, TOK_COLON, "lambda needs ':'");
+    NodeId body = parse_expr(parser);
+    if (body == NO_NODE) return NO_NODE;
+    NodeId lam = make_lambda(parser->ast, parser->n_binds - base, parser->binds + base, body,
+                             kw.line, kw.col);
+    parser->n_binds = base;
+    return lam;
+}
+
+NodeId parse_app(Parser *parser, NodeId func) {
+    int base = parser->n_pending;
+    while (peek(parser).type != TOK_RBRACE) {
+        NodeId arg = parse_expr(parser);
+        if (arg == NO_NODE || !push_pending(parser, arg)) return NO_NODE;
+    }
+    NodeId app = make_app(parser->ast, func, parser->n_pending - base, parser->pending + base);
+    parser->n_pending = base;
+    return app;
+}
+
+NodeId parse_if(Parser *parser) {
+    NodeId test = parse_expr(parser);
+    if (test == NO_NODE) return NO_NODE;
+    NodeId then_expr = parse_expr(parser);
+    if (then_expr == NO_NODE) return NO_NODE;
+    NodeId else_expr = parse_expr(parser);
+    if (else_expr == NO_NODE) return NO_NODE;
+    return make_if(parser->ast, test, then_expr, else_expr);
+}
+
+// desugars to ((lambda (names...) body) vals...); the lambda takes kw's position
+NodeId parse_let(Parser *parser, Token kw) {
+    expect(parser, TOK_LBRACE, "let needs '{'");
+
+    int names = parser->n_binds, vals = parser->n_pending;
+    while (match(parser, TOK_LBRACKET)) {
+        Token name = expect(parser, TOK_ID, "expected binding name");
+        if (name.type == TOK_ERROR) return NO_NODE;
+
+        Token next = peek(parser);
+        if (next.type == TOK_IF || next.type == TOK_LAMBDA || next.type == TOK_LET) {
+            report("keyword cannot be binding name\n");
+            return NO_NODE;
+        }
+        if (!push_bind(parser, names, name.as.name, "binding")) return NO_NODE;
+
+        expect(parser, TOK_EQUALS, "binding needs '='");
+        NodeId val = parse_expr(parser);
+        if (val == NO_NODE || !push_pending(parser, val)) return NO_NODE;
+
+        expect(parser, TOK_RBRACKET, "binding needs ']'");
+    }
+
+    expect(parser, TOK_RBRACE, "let needs '}'");
+    expect(parser, TOK_IN, "let needs 'in'");
+    NodeId body = parse_expr(parser);
+    if (body == NO_NODE) return NO_NODE;
+    expect(parser, TOK_END, "let needs 'end'");
+
+    int count = parser->n_binds - names;
+    NodeId lam = make_lambda(parser->ast, count, parser->binds + names, body, kw.line, kw.col);
+    parser->n_binds = names;
+    if (lam == NO_NODE) return NO_NODE;
+    NodeId app = make_app(parser->ast, lam, count, parser->pending + vals);
+    parser->n_pending = vals;
+    return app;
+}
+
+NodeId parse_braced(Parser *parser) {
+    expect(parser, TOK_LBRACE, "expected '{'");
+    Token tok = peek(parser);
+    NodeId node;
+
+    if (tok.type == TOK_IF) {
+        advance(parser);
+        node = parse_if(parser);
+    }
+    else if (tok.type == TOK_LAMBDA) {
+        advance(parser);
+        node = parse_lambda(parser, tok);
+    }
+    else if (tok.type == TOK_LET) {
+        advance(parser);
+        node = parse_let(parser, tok);
+    }
+    else {
+        NodeId func = parse_expr(parser);
+        if (func == NO_NODE) return NO_NODE;
+        node = parse_app(parser, func);
+    }
+
+    if (node == NO_NODE) return NO_NODE;
+    expect(parser, TOK_RBRACE, "expected '}'");
+    return node;
+}
+
+// token stream -> ExprC (index of its root node); NO_NODE on syntax error
+NodeId parse_expr(Parser *parser) {
+    Token tok = peek(parser);
 
     switch (tok.type) {
         case TOK_LBRACE:
             return parse_braced(parser);
         case TOK_NUMBER: {
             advance(parser);
-            return make_num(parser->arena, strtod(tok.text, NULL));
+            return make_num(parser->ast, tok.as.num);
         }
         case TOK_STRING: {
             advance(parser);
             // strip surrounding quotes from token text
-            size_t len = strlen(tok.text) - 2;
-            return make_str(parser->arena, tok.text + 1, len);
+            return make_str(parser->ast, tok.start + 1, tok.len - 2);
         }
         case TOK_ID:
         case TOK_TRUE:
         case TOK_FALSE:
             advance(parser);
-            return make_id(parser->arena, tok.text);
+            return make_id(parser->ast, tok.as.name);
+        case TOK_ERROR:
+            return NO_NODE;
         default:
-            fprintf(stderr, "SHEQ: unexpected token at line %d col %d\n", tok.line, tok.col);
-            return NULL;
+            report("unexpected token at line %d col %d\n", tok.line, tok.col);
+            return NO_NODE;
     }
 }
 
-// Value -> string representation (caller must free)
-char *serialize(Value *val) {
-    // static buffer simplifies memory management; 4KB sufficient for typical values
-    static char buf[4096];
-    switch (val->type) {
-        case VAL_NUMV:
-            snprintf(buf, sizeof(buf), "%.15g", val->as.num);
-            break;
-        case VAL_STRV: {
-            char *ptr = buf;
-            *ptr++ = '"';
-            // stop at 4000 to leave room for escape expansion and closing quote
-            for (size_t i = 0; i < val->as.str.len && ptr < buf + 4000; i++) {
-                char ch = val->as.str.data[i];
-                if (ch == '"') { *ptr++ = '\\'; *ptr++ = '"'; }
-                else if (ch == '\\') { *ptr++ = '\\'; *ptr++ = '\\'; }
-                else if (ch == '\n') { *ptr++ = '\\'; *ptr++ = 'n'; }
-                else *ptr++ = ch;
+// growable output text; results are serialized into one and written with a
+// single fwrite, with no length cap and no intermediate copies
+typedef struct {
+    char *data;
+    size_t len, cap;
+} OutBuf;
+
+int out_reserve(OutBuf *out, size_t n) {
+    if (out->len + n <= out->cap) return 1;
+    size_t cap = out->cap ? out->cap * 2 : 256;
+    while (cap < out->len + n) cap *= 2;
+    char *grown = realloc(out->data, cap);
+    if (!grown) {
+        report("malloc failed\n");
+        return 0;
+    }
+    out->data = grown;
+    out->cap = cap;
+    return 1;
+}
+
+int out_append(OutBuf *out, const char *text, size_t len) {
+    if (!out_reserve(out, len)) return 0;
+    memcpy(out->data + out->len, text, len);
+    out->len += len;
+    return 1;
+}
+
+// powers of ten a double holds exactly
+static const double exact_pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// what nd digits (no point), with the first at 10^exp, read back as
+static double digits_value(const char *digits, int nd, int exp) {
+    unsigned long long mant = 0;
+    for (int i = 0; i < nd; i++) mant = mant * 10 + (digits[i] - '0');
+    int scale = exp - (nd - 1);
+    // an exact mantissa and power of ten round once, correctly, same as strtod
+    if (mant <= (1ull << 53) && scale >= -22 && scale <= 22)
+        return scale < 0 ? (double)mant / exact_pow10[-scale] : (double)mant * exact_pow10[scale];
+    char text[40];
+    snprintf(text, sizeof(text), "%.*se%d", nd, digits, scale);
+    return strtod(text, NULL);
+}
+
+// num in the fewest of 15, 16 or 17 significant digits that read back exactly,
+// laid out the way "%.Ng" would. whole numbers below 1e15 skip all of it
+int out_number(OutBuf *out, double num) {
+    if (!out_reserve(out, 32)) return 0;
+    char *dst = out->data + out->len;
+    if (num > -1e15 && num < 1e15 && num == (double)(long long)num && (num != 0 || 1 / num > 0)) {
+        unsigned long long mag = num < 0 ? (unsigned long long)-num : (unsigned long long)num;
+        char digits[20];
+        int n = 0;
+        do {
+            digits[n++] = (char)('0' + mag % 10);
+            mag /= 10;
+        } while (mag);
+        if (num < 0) *dst++ = '-';
+        while (n) *dst++ = digits[--n];
+        out->len = dst - out->data;
+        return 1;
+    }
+    // nan, infinities and -0
+    if (num - num != 0 || num == 0) {
+        out->len += snprintf(dst, 32, "%.15g", num);
+        return 1;
+    }
+
+    // 17 digits always read back; format them once, then try rounding to fewer
+    double mag = num < 0 ? -num : num;
+    char sci[32];
+    snprintf(sci, sizeof(sci), "%.16e", mag);
+    char all[17];
+    all[0] = sci[0];
+    memcpy(all + 1, sci + 2, 16);
+    int exp17 = atoi(sci + 19);
+
+    char digits[17];
+    int prec = 17, exp = exp17;
+    memcpy(digits, all, 17);
+    for (int p = 15; p <= 16; p++) {
+        char cand[17];
+        int cexp = exp17;
+        // the 17 digits are rounded themselves: if what they drop is exactly 5
+        // or 50, the real tail may be just under or over half. ask snprintf
+        int tie = all[p] == '5';
+        for (int i = p + 1; i < 17; i++) tie = tie && all[i] == '0';
+        if (tie) {
+            char text[32];
+            snprintf(text, sizeof(text), "%.*e", p - 1, mag);
+            cand[0] = text[0];
+            memcpy(cand + 1, text + 2, p - 1);
+            cexp = atoi(text + p + 2);
+        } else {
+            memcpy(cand, all, p);
+            if (all[p] >= '5') {
+                int i = p - 1;
+                while (i >= 0 && cand[i] == '9') cand[i--] = '0';
+                if (i >= 0) {
+                    cand[i]++;
+                } else {
+                    cand[0] = '1';
+                    cexp++;
+                }
             }
-            *ptr++ = '"';
-            *ptr = '\0';
-            break;
         }
-        case VAL_BOOLV:
-            snprintf(buf, sizeof(buf), "%s", val->as.boolval ? "true" : "false");
-            break;
-        case VAL_CLOSV:
-            snprintf(buf, sizeof(buf), "#<procedure>");
-            break;
-        case VAL_PRIMV:
-            snprintf(buf, sizeof(buf), "#<primop>");
+        if (digits_value(cand, p, cexp) == mag) {
+            memcpy(digits, cand, p);
+            prec = p;
+            exp = cexp;
             break;
-        default:
-            snprintf(buf, sizeof(buf), "#<unknown>");
+        }
+    }
+    int nd = prec;
+    while (nd > 1 && digits[nd - 1] == '0') nd--;
+
+    if (num < 0) *dst++ = '-';
+    if (exp < -4 || exp >= prec) {
+        *dst++ = digits[0];
+        if (nd > 1) {
+            *dst++ = '.';
+            memcpy(dst, digits + 1, nd - 1);
+            dst += nd - 1;
+        }
+        dst += sprintf(dst, "e%c%02d", exp < 0 ? '-' : '+', exp < 0 ? -exp : exp);
+    } else if (exp >= 0) {
+        for (int i = 0; i <= exp; i++) *dst++ = i < nd ? digits[i] : '0';
+        if (nd > exp + 1) {
+            *dst++ = '.';
+            memcpy(dst, digits + exp + 1, nd - exp - 1);
+            dst += nd - exp - 1;
+        }
+    } else {
+        *dst++ = '0';
+        *dst++ = '.';
+        for (int i = 0; i < -exp - 1; i++) *dst++ = '0';
+        memcpy(dst, digits, nd);
+        dst += nd;
+    }
+    out->len = dst - out->data;
+    return 1;
+}
+
+// string literal with ", \ and newlines escaped; plain runs are copied whole
+int out_string(OutBuf *out, const String *str) {
+    if (!out_append(out, "\"", 1) || !out_reserve(out, str->len)) return 0;
+    StrCursor cur;
+    cursor_init(&cur, str);
+    // ropes stream piece by piece; nothing is flattened first
+    for (const String *piece; (piece = cursor_next(&cur));) {
+        const char *data = piece->data, *end = data + piece->len;
+        while (data < end) {
+            const char *run = data;
+            while (run < end && *run != '"' && *run != '\\' && *run != '\n') run++;
+            if (!out_append(out, data, run - data)) return 0;
+            if (run == end) break;
+            const char *escaped = *run == '"' ? "\\\"" : *run == '\\' ? "\\\\" : "\\n";
+            if (!out_append(out, escaped, 2)) return 0;
+            data = run + 1;
+        }
+    }
+    return out_append(out, "\"", 1);
+}
+
+// Value -> its printed form, appended to out; 0 on malloc failure
+int serialize(OutBuf *out, const Value *val) {
+    switch (val->type) {
+        case VAL_NUMV:  return out_number(out, val->as.num);
+        case VAL_STRV:  return out_string(out, val->as.str);
+        case VAL_BOOLV: return val->as.boolval ? out_append(out, "true", 4) : out_append(out, "false", 5);
+        case VAL_CLOSV: return out_append(out, "#<procedure>", 12);
+        case VAL_PRIMV: return out_append(out, "#<primop>", 9);
+        default:        return out_append(out, "#<unknown>", 10);
     }
-    return strdup(buf);
 }
 
 const char *type_str(ValueType type) {
@@ -679,80 +1620,82 @@ const char *type_str(ValueType type) {
 
 int check_type(Value *val, ValueType want, const char *op) {
     if (val->type != want) {
-        fprintf(stderr, "SHEQ: %s expects %s, got %s\n", op, type_str(want), type_str(val->type));
+        report("%s expects %s, got %s\n", op, type_str(want), type_str(val->type));
         return 0;
     }
     return 1;
 }
 
-Value *interp(ASTNode *node, Env *env, Arena *arena);
-
-Value *prim_add(Value *args, int argc, Arena *arena) {
-    if (argc != 2) { fprintf(stderr, "SHEQ: + needs 2 args\n"); return NULL; }
-    if (!check_type(&args[0], VAL_NUMV, "+")) return NULL;
-    if (!check_type(&args[1], VAL_NUMV, "+")) return NULL;
-    Value *out = arena_alloc(arena, sizeof(Value));
-    if (!out) return NULL;
-    out->type = VAL_NUMV;
-    out->as.num = args[0].as.num + args[1].as.num;
-    return out;
-}
-
-Value *prim_sub(Value *args, int argc, Arena *arena) {
-    if (argc != 2) { fprintf(stderr, "SHEQ: - needs 2 args\n"); return NULL; }
-    if (!check_type(&args[0], VAL_NUMV, "-")) return NULL;
-    if (!check_type(&args[1], VAL_NUMV, "-")) return NULL;
-    Value *out = arena_alloc(arena, sizeof(Value));
-    if (!out) return NULL;
-    out->type = VAL_NUMV;
-    out->as.num = args[0].as.num - args[1].as.num;
-    return out;
-}
-
-Value *prim_mul(Value *args, int argc, Arena *arena) {
-    if (argc != 2) { fprintf(stderr, "SHEQ: * needs 2 args\n"); return NULL; }
-    if (!check_type(&args[0], VAL_NUMV, "*")) return NULL;
-    if (!check_type(&args[1], VAL_NUMV, "*")) return NULL;
-    Value *out = arena_alloc(arena, sizeof(Value));
-    if (!out) return NULL;
-    out->type = VAL_NUMV;
-    out->as.num = args[0].as.num * args[1].as.num;
-    return out;
-}
-
-Value *prim_div(Value *args, int argc, Arena *arena) {
-    if (argc != 2) { fprintf(stderr, "SHEQ: / needs 2 args\n"); return NULL; }
-    if (!check_type(&args[0], VAL_NUMV, "/")) return NULL;
-    if (!check_type(&args[1], VAL_NUMV, "/")) return NULL;
+Value interp(ASTNode *node, Env *env, Interp *in);
+
+Value prim_add(Value *args, int argc, Arena *arena) {
+    (void)arena;
+    if (argc != 2) { report("+ needs 2 args\n"); return errv(); }
+    if (!check_type(&args[0], VAL_NUMV, "+")) return errv();
+    if (!check_type(&args[1], VAL_NUMV, "+")) return errv();
+    return numv(args[0].as.num + args[1].as.num);
+}
+
+Value prim_sub(Value *args, int argc, Arena *arena) {
+    (void)arena;
+    if (argc != 2) { report("- needs 2 args\n"); return errv(); }
+    if (!check_type(&args[0], VAL_NUMV, "-")) return errv();
+    if (!check_type(&args[1], VAL_NUMV, "-")) return errv();
+    return numv(args[0].as.num - args[1].as.num);
+}
+
+Value prim_mul(Value *args, int argc, Arena *arena) {
+    (void)arena;
+    if (argc != 2) { report("* needs 2 args\n"); return errv(); }
+    if (!check_type(&args[0], VAL_NUMV, "*")) return errv();
+    if (!check_type(&args[1], VAL_NUMV, "*")) return errv();
+    return numv(args[0].as.num * args[1].as.num);
+}
+
+Value prim_div(Value *args, int argc, Arena *arena) {
+    (void)arena;
+    if (argc != 2) { report("/ needs 2 args\n"); return errv(); }
+    if (!check_type(&args[0], VAL_NUMV, "/")) return errv();
+    if (!check_type(&args[1], VAL_NUMV, "/")) return errv();
     if (args[1].as.num == 0.0) {
-        fprintf(stderr, "SHEQ: division by zero\n");
-        return NULL;
+        report("division by zero\n");
+        return errv();
     }
-    Value *out = arena_alloc(arena, sizeof(Value));
-    if (!out) return NULL;
-    out->type = VAL_NUMV;
-    out->as.num = args[0].as.num / args[1].as.num;
-    return out;
+    return numv(args[0].as.num / args[1].as.num);
 }
 
-Value *prim_lte(Value *args, int argc, Arena *arena) {
-    if (argc != 2) { fprintf(stderr, "SHEQ: <= needs 2 args\n"); return NULL; }
-    if (!check_type(&args[0], VAL_NUMV, "<=")) return NULL;
-    if (!check_type(&args[1], VAL_NUMV, "<=")) return NULL;
-    Value *out = arena_alloc(arena, sizeof(Value));
-    if (!out) return NULL;
-    out->type = VAL_BOOLV;
-    out->as.boolval = (args[0].as.num <= args[1].as.num);
-    return out;
+Value prim_lte(Value *args, int argc, Arena *arena) {
+    (void)arena;
+    if (argc != 2) { report("<= needs 2 args\n"); return errv(); }
+    if (!check_type(&args[0], VAL_NUMV, "<=")) return errv();
+    if (!check_type(&args[1], VAL_NUMV, "<=")) return errv();
+    return boolv(args[0].as.num <= args[1].as.num);
 }
 
 int str_eq(Value *lhs, Value *rhs) {
-    if (lhs->as.str.len != rhs->as.str.len) return 0;
-    return memcmp(lhs->as.str.data, rhs->as.str.data, lhs->as.str.len) == 0;
+    const String *a = lhs->as.str, *b = rhs->as.str;
+    if (a->len != b->len) return 0;
+    if (a->depth == 0 && b->depth == 0) return memcmp(a->data, b->data, a->len) == 0;
+    // walk both piece by piece, comparing the overlap of the current two
+    StrCursor ca, cb;
+    cursor_init(&ca, a);
+    cursor_init(&cb, b);
+    const String *pa = cursor_next(&ca), *pb = cursor_next(&cb);
+    size_t oa = 0, ob = 0;
+    while (pa && pb) {
+        size_t n = pa->len - oa < pb->len - ob ? pa->len - oa : pb->len - ob;
+        if (memcmp(pa->data + oa, pb->data + ob, n) != 0) return 0;
+        oa += n;
+        ob += n;
+        if (oa == pa->len) { pa = cursor_next(&ca); oa = 0; }
+        if (ob == pb->len) { pb = cursor_next(&cb); ob = 0; }
+    }
+    return 1;
 }
 
-Value *prim_equal(Value *args, int argc, Arena *arena) {
-    if (argc != 2) { fprintf(stderr, "SHEQ: equal? needs 2 args\n"); return NULL; }
+Value prim_equal(Value *args, int argc, Arena *arena) {
+    (void)arena;
+    if (argc != 2) { report("equal? needs 2 args\n"); return errv(); }
     Value *lhs = &args[0], *rhs = &args[1];
     int eq = 0;
 
@@ -769,215 +1712,3240 @@ Value *prim_equal(Value *args, int argc, Arena *arena) {
             default: eq = 0;
         }
     }
-
-    Value *out = arena_alloc(arena, sizeof(Value));
-    if (!out) return NULL;
-    out->type = VAL_BOOLV;
-    out->as.boolval = eq;
-    return out;
+    return boolv(eq);
 }
 
-Value *prim_substring(Value *args, int argc, Arena *arena) {
-    if (argc != 3) { fprintf(stderr, "SHEQ: substring needs 3 args\n"); return NULL; }
-    if (!check_type(&args[0], VAL_STRV, "substring")) return NULL;
-    if (!check_type(&args[1], VAL_NUMV, "substring")) return NULL;
-    if (!check_type(&args[2], VAL_NUMV, "substring")) return NULL;
+Value prim_substring(Value *args, int argc, Arena *arena) {
+    if (argc != 3) { report("substring needs 3 args\n"); return errv(); }
+    if (!check_type(&args[0], VAL_STRV, "substring")) return errv();
+    if (!check_type(&args[1], VAL_NUMV, "substring")) return errv();
+    if (!check_type(&args[2], VAL_NUMV, "substring")) return errv();
 
     int start = (int)args[1].as.num;
     int stop = (int)args[2].as.num;
-    size_t len = args[0].as.str.len;
+    size_t len = args[0].as.str->len;
 
     if (start < 0 || start > (int)len) {
-        fprintf(stderr, "SHEQ: substring start %d out of bounds\n", start);
-        return NULL;
+        report("substring start %d out of bounds\n", start);
+        return errv();
     }
     if (stop < start || stop > (int)len) {
-        fprintf(stderr, "SHEQ: substring stop %d out of bounds\n", stop);
-        return NULL;
+        report("substring stop %d out of bounds\n", stop);
+        return errv();
     }
 
-    Value *out = arena_alloc(arena, sizeof(Value));
-    if (!out) return NULL;
-    out->type = VAL_STRV;
-    out->as.str.len = stop - start;
-    out->as.str.data = arena_alloc(arena, out->as.str.len + 1);
-    if (!out->as.str.data) return NULL;
-    memcpy(out->as.str.data, args[0].as.str.data + start, out->as.str.len);
-    out->as.str.data[out->as.str.len] = '\0';
-    return out;
+    String *sub = string_sub(arena, args[0].as.str, start, stop);
+    return sub ? (Value){VAL_STRV, {.str = sub}} : errv();
 }
 
-Value *prim_strlen(Value *args, int argc, Arena *arena) {
-    if (argc != 1) { fprintf(stderr, "SHEQ: strlen needs 1 arg\n"); return NULL; }
-    if (!check_type(&args[0], VAL_STRV, "strlen")) return NULL;
-    Value *out = arena_alloc(arena, sizeof(Value));
-    if (!out) return NULL;
-    out->type = VAL_NUMV;
-    out->as.num = (double)args[0].as.str.len;
-    return out;
+Value prim_string_append(Value *args, int argc, Arena *arena) {
+    if (argc != 2) { report("string-append needs 2 args\n"); return errv(); }
+    if (!check_type(&args[0], VAL_STRV, "string-append")) return errv();
+    if (!check_type(&args[1], VAL_STRV, "string-append")) return errv();
+    String *str = string_concat(arena, args[0].as.str, args[1].as.str);
+    return str ? (Value){VAL_STRV, {.str = str}} : errv();
 }
 
-Value *prim_error(Value *args, int argc, Arena *arena) {
+Value prim_strlen(Value *args, int argc, Arena *arena) {
     (void)arena;
-    if (argc != 1) { fprintf(stderr, "SHEQ: error needs 1 arg\n"); return NULL; }
-    char *msg = serialize(&args[0]);
-    fprintf(stderr, "SHEQ: user-error: %s\n", msg);
-    free(msg);
-    return NULL;
+    if (argc != 1) { report("strlen needs 1 arg\n"); return errv(); }
+    if (!check_type(&args[0], VAL_STRV, "strlen")) return errv();
+    return numv((double)args[0].as.str->len);
 }
 
-// (ExprC, Env) -> Value; NULL on runtime error
-Value *interp(ASTNode *node, Env *env, Arena *arena) {
-    if (!node) {
-        fprintf(stderr, "SHEQ: null AST\n");
-        return NULL;
-    }
-
-    Value *out = arena_alloc(arena, sizeof(Value));
-    if (!out) return NULL;
-
-    switch (node->type) {
-        case NODE_NUMC:
-            out->type = VAL_NUMV;
-            out->as.num = node->as.num_val;
-            return out;
-
-        case NODE_STRC:
-            out->type = VAL_STRV;
-            out->as.str.data = node->as.str_val;
-            out->as.str.len = strlen(node->as.str_val);
-            return out;
-
-        case NODE_IDC: {
-            Value *val = lookup(env, node->as.var);
-            if (!val) {
-                fprintf(stderr, "SHEQ: unbound: %s\n", node->as.var);
-                return NULL;
-            }
-            return val;
-        }
+Value prim_error(Value *args, int argc, Arena *arena) {
+    (void)arena;
+    if (argc != 1) { report("error needs 1 arg\n"); return errv(); }
+    OutBuf msg = {0};
+    if (serialize(&msg, &args[0]))
+        report("user-error: %.*s\n", msg.len > INT_MAX ? INT_MAX : (int)msg.len, msg.data);
+    free(msg.data);
+    return errv();
+}
 
-        case NODE_IFC: {
-            Value *test_val = interp(node->as.if_node.test, env, arena);
-            if (!test_val) return NULL;
-            if (!check_type(test_val, VAL_BOOLV, "if")) return NULL;
-            return test_val->as.boolval
-                ? interp(node->as.if_node.then_expr, env, arena)
-                : interp(node->as.if_node.else_expr, env, arena);
-        }
+// functions and arities behind PrimOp
+const struct {
+    PrimFn fn;
+    int arity;
+} prim_ops[PRIM_COUNT] = {
+    [PRIM_ADD]       = {prim_add, 2},
+    [PRIM_SUB]       = {prim_sub, 2},
+    [PRIM_MUL]       = {prim_mul, 2},
+    [PRIM_DIV]       = {prim_div, 2},
+    [PRIM_LTE]       = {prim_lte, 2},
+    [PRIM_EQUAL]     = {prim_equal, 2},
+    [PRIM_SUBSTRING] = {prim_substring, 3},
+    [PRIM_STRLEN]    = {prim_strlen, 1},
+    [PRIM_APPEND]    = {prim_string_append, 2},
+};
 
-        case NODE_LAMC:
-            out->type = VAL_CLOSV;
-            out->as.clos.param_count = node->as.lam_node.param_count;
-            out->as.clos.params = node->as.lam_node.params;
-            out->as.clos.body = node->as.lam_node.body;
-            out->as.clos.env = env;
-            return out;
+// true if val references memory allocated since mark (so rewinding would dangle it).
+// objects never point at anything newer than themselves, so the header is enough
+int value_escapes(Arena *arena, ArenaMark mark, const Value *val) {
+    switch (val->type) {
+        case VAL_STRV:  return arena_since(arena, mark, val->as.str);
+        case VAL_CLOSV: return arena_since(arena, mark, val->as.clos);
+        default:        return 0;
+    }
+}
 
-        case NODE_APPC: {
-            ASTNode **children = node->as.app_node.children;
-            int n_args = node->as.app_node.child_count - 1;
+// finish an interp call: drop everything it allocated unless the result points into it
+static inline Value interp_return(Arena *arena, ArenaMark mark, Value result) {
+    if (arena->head == mark.chunk && arena->head->used == mark.used) return result;
+    if (!value_escapes(arena, mark, &result)) arena_rewind(arena, mark);
+    return result;
+}
 
-            Value *func = interp(children[0], env, arena);
-            if (!func) return NULL;
+// tail calls with more args than this keep their old frames instead of copying
+#define TAIL_COPY_MAX 16
 
-            Value *argv = NULL;
-            if (n_args > 0) {
-                argv = arena_alloc(arena, sizeof(Value) * n_args);
-                if (!argv) return NULL;
-            }
-            for (int i = 0; i < n_args; i++) {
-                Value *arg = interp(children[i + 1], env, arena);
-                if (!arg) return NULL;
-                argv[i] = *arg;
-            }
+#if defined(__GNUC__)
+#define NOINLINE __attribute__((noinline))
+#else
+#define NOINLINE
+#endif
 
-            if (func->type == VAL_CLOSV) {
-                if (func->as.clos.param_count != n_args) {
-                    fprintf(stderr, "SHEQ: arity mismatch: want %d, got %d\n",
-                            func->as.clos.param_count, n_args);
-                    return NULL;
-                }
-                // extend closure's captured env, not call-site env (lexical scoping)
-                Env *call_env = extend_env(arena, func->as.clos.env,
-                                           func->as.clos.param_count,
-                                           func->as.clos.params, argv);
-                if (!call_env) return NULL;
-                return interp(func->as.clos.body, call_env, arena);
-            }
-            else if (func->type == VAL_PRIMV) {
-                return func->as.prim(argv, n_args, arena);
-            }
-            else {
-                fprintf(stderr, "SHEQ: cannot apply non-function\n");
-                return NULL;
-            }
-        }
+// frame for a tail call, moved down to mark when nothing still points past it.
+// kept out of interp so the copy buffer doesn't sit in every recursive C frame
+NOINLINE Env *tail_frame(Arena *arena, ArenaMark mark, Env *frame) {
+    int n_args = frame->count;
+    Closure *clos = frame->clos;
+    // the old frame and the call's temporaries are dead once the new frame is
+    // built, unless the callee or an argument still points into them
+    if (n_args > TAIL_COPY_MAX || arena_since(arena, mark, clos)) return frame;
+    for (int i = 0; i < n_args; i++) {
+        if (value_escapes(arena, mark, &frame->slots[i])) return frame;
     }
 
-    fprintf(stderr, "SHEQ: unknown node type\n");
-    return NULL;
+    Value saved[TAIL_COPY_MAX];
+    memcpy(saved, frame->slots, sizeof(Value) * n_args);
+    arena_rewind(arena, mark);
+    frame = alloc_env(arena, clos, n_args);
+    if (!frame) return NULL;
+    memcpy(frame->slots, saved, sizeof(Value) * n_args);
+    return frame;
 }
 
-// top-level env with primitives (+, -, *, /, <=, equal?, etc.) and true/false
-Env *make_top_env(Arena *arena) {
-    Env *env = create_env(arena, NULL);
-    if (!env) return NULL;
-
-    Value prim_val;
-    prim_val.type = VAL_PRIMV;
+// --parallel: argument subtrees that make calls are evaluated as futures on a
+// pool of worker threads. there's no mutation, so sibling args can't see each
+// other. a worker evaluates into an arena of its own, and the joining thread
+// copies the result out before handing the arena back. joining a future nobody
+// has started runs it inline; waiting on one that is running helps with others
+typedef struct Future {
+    const Ast *ast;
+    ASTNode *node;
+    Env *env;
+    _Atomic int done;
+    Value result;
+    Arena *arena;           // a worker's result lives here; NULL if run inline
+    ArenaMark base;         // arena's empty position
+    char msg[REPORT_MAX];   // a worker's error message, reported again at the join
+    struct Future *next;
+} Future;
 
-    prim_val.as.prim = prim_add;        if (!bind_env(arena, env, "+", prim_val)) return NULL;
-    prim_val.as.prim = prim_sub;        if (!bind_env(arena, env, "-", prim_val)) return NULL;
-    prim_val.as.prim = prim_mul;        if (!bind_env(arena, env, "*", prim_val)) return NULL;
-    prim_val.as.prim = prim_div;        if (!bind_env(arena, env, "/", prim_val)) return NULL;
-    prim_val.as.prim = prim_lte;        if (!bind_env(arena, env, "<=", prim_val)) return NULL;
-    prim_val.as.prim = prim_equal;      if (!bind_env(arena, env, "equal?", prim_val)) return NULL;
-    prim_val.as.prim = prim_substring;  if (!bind_env(arena, env, "substring", prim_val)) return NULL;
-    prim_val.as.prim = prim_strlen;     if (!bind_env(arena, env, "strlen", prim_val)) return NULL;
-    prim_val.as.prim = prim_error;      if (!bind_env(arena, env, "error", prim_val)) return NULL;
+// args past this many in one call are never forked
+#define FORK_MAX 32
 
-    Value bool_val;
-    bool_val.type = VAL_BOOLV;
-    bool_val.as.boolval = 1; if (!bind_env(arena, env, "true", bool_val)) return NULL;
-    bool_val.as.boolval = 0; if (!bind_env(arena, env, "false", bool_val)) return NULL;
+struct TaskPool {
+    pthread_mutex_t lock;
+    pthread_cond_t work;    // a future was queued, or stop
+    pthread_cond_t done;    // a future finished
+    Future *head, *tail;    // queued and not yet started
+    _Atomic int queued;
+    _Atomic int idle;       // workers waiting for a future
+    int stop;
+    Value *globals;
+    pthread_t *threads;
+    int n_threads;
+    Arena **spare;          // empty arenas for the next futures
+    int n_spare, spare_cap;
+};
 
-    return env;
+// fork only while some worker is idle with nothing queued for it; past that
+// the forking thread is better off evaluating the arg itself
+static Future *task_fork(TaskPool *pool, const Ast *ast, ASTNode *node, Env *env) {
+    if (atomic_load_explicit(&pool->queued, memory_order_relaxed) >=
+        atomic_load_explicit(&pool->idle, memory_order_relaxed)) return NULL;
+    Future *f = malloc(sizeof(Future));
+    if (!f) return NULL;
+    f->ast = ast;
+    f->node = node;
+    f->env = env;
+    atomic_init(&f->done, 0);
+    f->arena = NULL;
+    f->msg[0] = '\0';
+    f->next = NULL;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tail) pool->tail->next = f;
+    else pool->head = f;
+    pool->tail = f;
+    pool->queued++;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    return f;
 }
 
-// source string -> prints serialized result; returns 0 on success
-int top_interp(const char *src) {
-    // 1MB sufficient for typical programs with deep nesting
-    Arena *arena = arena_create(1024 * 1024);
-    if (!arena) return 1;
-
-    TokenStream *ts = tokenize(arena, src);
-    if (!ts) { arena_destroy(arena); return 1; }
+// take f (or the oldest future if f is NULL) off the queue; call with lock held
+static Future *task_take(TaskPool *pool, Future *f) {
+    Future **link = &pool->head, *prev = NULL;
+    while (*link && f && *link != f) {
+        prev = *link;
+        link = &(*link)->next;
+    }
+    Future *got = *link;
+    if (!got) return NULL;
+    *link = got->next;
+    if (pool->tail == got) pool->tail = prev;
+    pool->queued--;
+    return got;
+}
 
-    Parser parser = {ts, arena};
-    ASTNode *ast = parse_expr(&parser);
-    if (!ast) { arena_destroy(arena); return 1; }
+// evaluate a future on a worker's behalf, into an arena of its own
+static void task_run(TaskPool *pool, Future *f) {
+    pthread_mutex_lock(&pool->lock);
+    Arena *arena = pool->n_spare ? pool->spare[--pool->n_spare] : NULL;
+    pthread_mutex_unlock(&pool->lock);
+    if (!arena) arena = arena_create(64 * 1024, 0);
 
-    Env *env = make_top_env(arena);
-    if (!env) { arena_destroy(arena); return 1; }
+    char *outer = report_buf;
+    report_buf = f->msg;
+    if (arena) {
+        f->arena = arena;
+        f->base = arena_mark(arena);
+        // forked args run without the memo; its table belongs to the main thread
+        Interp in = {f->ast, arena, pool->globals, pool, NULL, NULL, 0};
+        f->result = interp(f->node, f->env, &in);
+    } else {
+        f->result = errv();
+    }
+    report_buf = outer;
 
-    Value *val = interp(ast, env, arena);
-    if (!val) { arena_destroy(arena); return 1; }
+    pthread_mutex_lock(&pool->lock);
+    atomic_store(&f->done, 1);
+    pthread_cond_broadcast(&pool->done);
+    pthread_mutex_unlock(&pool->lock);
+}
 
-    char *out = serialize(val);
-    if (out) {
-        printf("%s\n", out);
-        free(out);
+static void *task_worker(void *arg) {
+    TaskPool *pool = arg;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        Future *f = task_take(pool, NULL);
+        if (f) {
+            pthread_mutex_unlock(&pool->lock);
+            task_run(pool, f);
+            pthread_mutex_lock(&pool->lock);
+        } else if (pool->stop) {
+            break;
+        } else {
+            pool->idle++;
+            pthread_cond_wait(&pool->work, &pool->lock);
+            pool->idle--;
+        }
     }
-
-    arena_destroy(arena);
-    return 0;
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
 }
 
-int main(int argc, char **argv) {
-    if (argc != 2) {
-        fprintf(stderr, "usage: sheq4 '<expr>'\n");
-        return 1;
+// a worker's result, copied into arena; children before parents, so objects
+// still never point at anything newer than themselves
+static Value copy_value(Arena *arena, Arena *from, ArenaMark base, Value val) {
+    if (!value_escapes(from, base, &val)) return val;
+    if (val.type == VAL_STRV) {
+        String *str = string_flatten(arena, val.as.str);
+        return str ? (Value){VAL_STRV, {.str = str}} : errv();
+    }
+    Closure *old = val.as.clos;
+    int n = old->capture_count;
+    Value *captures = malloc(sizeof(Value) * (n ? n : 1));
+    if (!captures) return errv();
+    for (int i = 0; i < n; i++) {
+        captures[i] = copy_value(arena, from, base, old->captures[i]);
+        if (captures[i].type == VAL_ERROR) {
+            free(captures);
+            return errv();
+        }
+    }
+    Closure *clos = alloc_closure(arena, n);
+    if (clos) {
+        *clos = *old;
+        memcpy(clos->captures, captures, sizeof(Value) * n);
+    }
+    free(captures);
+    return clos ? (Value){VAL_CLOSV, {.clos = clos}} : errv();
+}
+
+// wait for f and free it; its value lands in in's arena. without keep, the
+// value isn't wanted: a future nobody started is dropped and errors stay quiet
+static Value task_join(Interp *in, Future *f, int keep) {
+    TaskPool *pool = in->tasks;
+    pthread_mutex_lock(&pool->lock);
+    if (!atomic_load(&f->done) && task_take(pool, f) == f) {
+        pthread_mutex_unlock(&pool->lock);
+        f->result = keep ? interp(f->node, f->env, in) : errv();
+    } else {
+        while (!atomic_load(&f->done)) {
+            Future *other = task_take(pool, NULL);
+            if (other) {
+                pthread_mutex_unlock(&pool->lock);
+                task_run(pool, other);
+                pthread_mutex_lock(&pool->lock);
+            } else {
+                pthread_cond_wait(&pool->done, &pool->lock);
+            }
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    Value val = f->result;
+    if (f->arena) {
+        if (!keep) val = errv();
+        else if (val.type == VAL_ERROR) report("%s\n", f->msg[0] ? f->msg : "malloc failed");
+        else val = copy_value(in->arena, f->arena, f->base, val);
+        arena_rewind(f->arena, f->base);
+        pthread_mutex_lock(&pool->lock);
+        if (pool->n_spare == pool->spare_cap) {
+            int cap = pool->spare_cap ? pool->spare_cap * 2 : 16;
+            Arena **grown = realloc(pool->spare, sizeof(Arena *) * cap);
+            if (grown) {
+                pool->spare = grown;
+                pool->spare_cap = cap;
+            }
+        }
+        if (pool->n_spare < pool->spare_cap) pool->spare[pool->n_spare++] = f->arena;
+        else arena_destroy(f->arena);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    free(f);
+    return val;
+}
+
+// evaluate n args into out; 0 if any failed. with a pool, the args fork_mask
+// marks are forked, except the last, which runs here along with the unmarked
+// ones: forking it would only leave this thread waiting
+NOINLINE static int eval_args(const NodeId *args, int n, unsigned fork_mask, Env *env, Interp *in, Value *out) {
+    ASTNode *nodes = in->ast->nodes;
+    Future *forked[FORK_MAX];
+    unsigned pending = 0;
+    if (in->tasks && fork_mask) {
+        int last = 0;
+        for (int i = 0; i < n && i < FORK_MAX; i++)
+            if (fork_mask >> i & 1) last = i;
+        for (int i = 0; i < last; i++)
+            if (fork_mask >> i & 1 && (forked[i] = task_fork(in->tasks, in->ast, &nodes[args[i]], env)))
+                pending |= 1u << i;
+    }
+
+    int ok = 1;
+    for (int i = 0; i < n && ok; i++) {
+        if (i < FORK_MAX && pending >> i & 1) continue;
+        out[i] = interp(&nodes[args[i]], env, in);
+        ok = out[i].type != VAL_ERROR;
+    }
+    // every fork is joined, even after an error: they read env, which the caller may free
+    for (int i = 0; pending; i++) {
+        if (!(pending >> i & 1)) continue;
+        pending &= ~(1u << i);
+        out[i] = task_join(in, forked[i], ok);
+        ok = ok && out[i].type != VAL_ERROR;
+    }
+    return ok;
+}
+
+TaskPool *task_pool_create(int n_threads, Value *globals) {
+    TaskPool *pool = calloc(1, sizeof(TaskPool));
+    if (!pool) {
+        report("malloc failed\n");
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->globals = globals;
+    pool->threads = malloc(sizeof(pthread_t) * n_threads);
+    if (pool->threads) {
+        for (; pool->n_threads < n_threads; pool->n_threads++)
+            if (pthread_create(&pool->threads[pool->n_threads], NULL, task_worker, pool) != 0) break;
+    }
+    if (pool->n_threads == 0) report("cannot start parallel workers\n");
+    return pool;
+}
+
+void task_pool_destroy(TaskPool *pool) {
+    if (!pool) return;
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->n_threads; i++) pthread_join(pool->threads[i], NULL);
+    for (int i = 0; i < pool->n_spare; i++) arena_destroy(pool->spare[i]);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->done);
+    free(pool->threads);
+    free(pool->spare);
+    free(pool);
+}
+
+double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// --profile: evaluations by node type, calls by primitive, and per lambda its
+// calls, time and arena bytes. activations follow the interp's non-tail calls;
+// a tail call ends the running activation and starts the callee's in its place,
+// as it does with the frame
+
+#define PROF_PRIMS 16           // distinct primitives counted; more than top_bindings has
+
+typedef struct {
+    uint64_t calls;
+    double incl_ms, excl_ms;
+    uint64_t incl_bytes, excl_bytes;
+    int active;             // activations on the stack; only the outermost adds inclusive totals
+} ProfLambda;
+
+// calling-context tree: one site per distinct stack of lambdas, for folded stacks
+typedef struct {
+    int lam;
+    int parent, child, next;    // first child and next sibling; -1 ends a list
+    double self_ms;
+} ProfSite;
+
+typedef struct {
+    int lam;
+    int site;
+    double start, child_ms;     // child_ms: inclusive time of the calls it made
+    size_t start_bytes, child_bytes;
+} ProfFrame;
+
+struct Profile {
+    const Ast *ast;         // the program being run; set by prof_begin
+    Arena *arena;           // where the bytes counted against lambdas come from
+    int *lam_of;            // per node: the LamInfo whose body it is
+    ProfLambda *lams;       // per LamInfo, then one for the top level
+    int n_lams;
+    uint64_t nodes[NODE_PRIMC + 1];
+    struct { PrimFn fn; uint64_t calls; } prims[PROF_PRIMS];
+    ProfFrame *stack;
+    int depth, stack_cap;
+    ProfSite *sites;
+    int n_sites, sites_cap;
+    const char *folded;     // --profile-folded: where to write folded stacks; NULL otherwise
+};
+
+void prof_prim(Profile *prof, PrimFn fn) {
+    for (int i = 0; i < PROF_PRIMS; i++) {
+        if (prof->prims[i].fn == fn || !prof->prims[i].fn) {
+            prof->prims[i].fn = fn;
+            prof->prims[i].calls++;
+            return;
+        }
+    }
+}
+
+// the child of site parent for lambda lam, added if new; -1 if out of memory
+static int prof_site(Profile *prof, int lam, int parent) {
+    int site = parent < 0 ? -1 : prof->sites[parent].child;
+    while (site >= 0 && prof->sites[site].lam != lam) site = prof->sites[site].next;
+    if (site >= 0) return site;
+    if (!grow_buf((void **)&prof->sites, &prof->sites_cap, prof->n_sites + 1, sizeof(ProfSite)))
+        return -1;
+    site = prof->n_sites++;
+    prof->sites[site] = (ProfSite){lam, parent, -1, -1, 0};
+    if (parent >= 0) {
+        prof->sites[site].next = prof->sites[parent].child;
+        prof->sites[parent].child = site;
+    }
+    return site;
+}
+
+// start an activation at time now; the caller makes room on the stack
+static void prof_push(Profile *prof, int lam, int site, double now) {
+    prof->stack[prof->depth++] = (ProfFrame){lam, site, now, 0, prof->arena->allocated, 0};
+    prof->lams[lam].calls++;
+    prof->lams[lam].active++;
+}
+
+// end the top activation at time now: credit its lambda, its site and its caller
+static void prof_pop(Profile *prof, double now) {
+    ProfFrame *f = &prof->stack[--prof->depth];
+    double incl = now - f->start;
+    size_t bytes = prof->arena->allocated - f->start_bytes;
+    ProfLambda *lam = &prof->lams[f->lam];
+    lam->excl_ms += incl - f->child_ms;
+    lam->excl_bytes += bytes - f->child_bytes;
+    // a recursive call's span is inside the outermost one's; adding it would count it twice
+    if (--lam->active == 0) {
+        lam->incl_ms += incl;
+        lam->incl_bytes += bytes;
+    }
+    prof->sites[f->site].self_ms += incl - f->child_ms;
+    if (prof->depth > 0) {
+        prof->stack[prof->depth - 1].child_ms += incl;
+        prof->stack[prof->depth - 1].child_bytes += bytes;
+    }
+}
+
+// a tail call to clos from the top activation; 0 if out of memory
+int prof_tail(Profile *prof, Closure *clos) {
+    int lam = prof->lam_of[clos->body - prof->ast->nodes];
+    int site = prof_site(prof, lam, prof->sites[prof->stack[prof->depth - 1].site].parent);
+    if (site < 0) return 0;
+    // one clock read: the time between the two belongs to neither, so it would go to the caller
+    double now = now_ms();
+    prof_pop(prof, now);
+    prof_push(prof, lam, site, now);
+    return 1;
+}
+
+// PrimC: evaluate args, then the inline fast path; anything unusual (type errors,
+// division by zero) goes through the PrimFn so behavior and messages match
+Value interp_prim(ASTNode *node, Env *env, Interp *in) {
+    Value args[3];
+    int n = node->as.prim_node.arg_count;
+    const NodeId *arg_ids = in->ast->kids + node->as.prim_node.args;
+    if (in->tasks) {
+        if (!eval_args(arg_ids, n, node->as.prim_node.fork_mask, env, in, args))
+            return errv();
+    } else {
+        for (int i = 0; i < n; i++) {
+            args[i] = interp(&in->ast->nodes[arg_ids[i]], env, in);
+            if (args[i].type == VAL_ERROR) return args[i];
+        }
+    }
+
+    PrimOp op = node->op;
+    if (in->prof) prof_prim(in->prof, prim_ops[op].fn);
+    if (op <= PRIM_LTE && args[0].type == VAL_NUMV && args[1].type == VAL_NUMV) {
+        double a = args[0].as.num, b = args[1].as.num;
+        switch (op) {
+            case PRIM_ADD: return numv(a + b);
+            case PRIM_SUB: return numv(a - b);
+            case PRIM_MUL: return numv(a * b);
+            case PRIM_DIV: if (b != 0.0) return numv(a / b); break;
+            case PRIM_LTE: return boolv(a <= b);
+            default: break;
+        }
+    }
+    else if (op == PRIM_STRLEN && args[0].type == VAL_STRV) {
+        return numv((double)args[0].as.str->len);
+    }
+    return prim_ops[op].fn(args, n, in->arena);
+}
+
+// build a closure for a LamC, copying its free variables out of the current frame
+Value make_closure(Arena *arena, const Ast *ast, ASTNode *node, Env *env) {
+    const LamInfo *lam = &ast->lams[node->as.lam_node.info];
+    int n = lam->capture_count;
+    Closure *clos = alloc_closure(arena, n);
+    if (!clos) return errv();
+    clos->param_count = lam->param_count;
+    clos->capture_count = n;
+    clos->body = &ast->nodes[node->as.lam_node.body];
+    clos->proto = NULL;
+    const VarRef *captures = ast->refs + lam->captures;
+    for (int i = 0; i < n; i++) {
+        VarRef ref = captures[i];
+        clos->captures[i] = ref.kind == VAR_LOCAL ? env->slots[ref.slot] : env->clos->captures[ref.slot];
+    }
+    return (Value){VAL_CLOSV, {.clos = clos}};
+}
+
+// --memo: there's no mutation, so a closure call's result depends only on the
+// lambda, its captures and its args. the table maps those to results with LRU
+// eviction. numbers, strings and booleans compare as equal? does; closures
+// compare structurally (same lambda, equal captures) rather than never, so
+// self-passing recursion like {fib fib n} hits. strings and closures in keys
+// and results are copied into the memo's own arena, which only empties between
+// programs, since a program may still hold an evicted result
+#define MEMO_ENTRIES (1 << 16)
+#define MEMO_KEY_MAX 8          // captures plus args of a memoizable call
+#define MEMO_DEPTH 4            // closures nested in a key or result value
+#define MEMO_BYTES_MAX (64 * 1024 * 1024)   // copies kept before new ones are refused
+
+typedef struct {
+    ASTNode *body;          // the lambda; NULL when the entry is free
+    size_t hash;
+    int n;
+    Value key[MEMO_KEY_MAX];
+    Value result;
+    int prev, next;         // LRU list, most recent first; -1 ends it
+} MemoEntry;
+
+struct Memo {
+    MemoEntry *entries;
+    int count;
+    int *index;             // open addressing over entries, 2x as many slots; -1 empty
+    size_t mask;
+    int head, tail;
+    Arena *arena;
+    ArenaMark base;
+    size_t bytes;
+    int verbose;            // --memo-stats: report on exit
+    size_t hits, misses, evictions, refused;
+};
+
+Memo *memo_create(int verbose) {
+    Memo *memo = calloc(1, sizeof(Memo));
+    if (!memo) {
+        report("malloc failed\n");
+        return NULL;
+    }
+    memo->entries = malloc(sizeof(MemoEntry) * MEMO_ENTRIES);
+    memo->index = malloc(sizeof(int) * 2 * MEMO_ENTRIES);
+    memo->arena = arena_create(64 * 1024, 0);
+    if (!memo->entries || !memo->index || !memo->arena) {
+        report("malloc failed\n");
+        free(memo->entries);
+        free(memo->index);
+        arena_destroy(memo->arena);
+        free(memo);
+        return NULL;
+    }
+    memo->mask = 2 * MEMO_ENTRIES - 1;
+    memo->base = arena_mark(memo->arena);
+    memo->verbose = verbose;
+    memset(memo->index, -1, sizeof(int) * 2 * MEMO_ENTRIES);
+    memo->head = memo->tail = -1;
+    return memo;
+}
+
+// forget every entry; counters carry on
+void memo_reset(Memo *memo) {
+    if (memo->count) memset(memo->index, -1, sizeof(int) * 2 * MEMO_ENTRIES);
+    memo->count = 0;
+    memo->head = memo->tail = -1;
+    arena_rewind(memo->arena, memo->base);
+    memo->bytes = 0;
+}
+
+void memo_destroy(Memo *memo) {
+    if (!memo) return;
+    if (memo->verbose) {
+        size_t calls = memo->hits + memo->misses;
+        fprintf(stderr, "SHEQ: memo: %zu hits, %zu misses (%.1f%% hit rate), "
+                "%zu evictions, %zu not stored\n", memo->hits, memo->misses,
+                calls ? 100.0 * memo->hits / calls : 0.0, memo->evictions, memo->refused);
+    }
+    free(memo->entries);
+    free(memo->index);
+    arena_destroy(memo->arena);
+    free(memo);
+}
+
+// hash of a key value; 0 in *ok if it nests closures too deep to compare
+static size_t memo_hash(const Value *val, int depth, int *ok) {
+    switch (val->type) {
+        case VAL_NUMV: {
+            // by bits, like memo_equal: -0 and 0 are different keys
+            uint64_t bits;
+            memcpy(&bits, &val->as.num, sizeof(bits));
+            // small integers only set the high bits
+            bits ^= bits >> 32;
+            return (size_t)(bits * 0x9E3779B97F4A7C15ull);
+        }
+        case VAL_STRV: {
+            // by content, so a rope and a flat copy of it hash alike
+            StrCursor cur;
+            cursor_init(&cur, val->as.str);
+            size_t hash = HASH_BASIS;
+            for (const String *piece; (piece = cursor_next(&cur));)
+                hash = hash_more(hash, piece->data, piece->len);
+            return hash;
+        }
+        case VAL_BOOLV: return (size_t)val->as.boolval + 1;
+        case VAL_PRIMV: return hash_ptr((const void *)(uintptr_t)val->as.prim);
+        case VAL_CLOSV: {
+            Closure *clos = val->as.clos;
+            if (depth == 0) {
+                *ok = 0;
+                return 0;
+            }
+            size_t hash = hash_ptr(clos->body);
+            for (int i = 0; i < clos->capture_count; i++)
+                hash = hash * 31 + memo_hash(&clos->captures[i], depth - 1, ok);
+            return hash;
+        }
+        default:
+            *ok = 0;
+            return 0;
+    }
+}
+
+static int memo_equal(const Value *a, const Value *b) {
+    if (a->type != b->type) return 0;
+    switch (a->type) {
+        // bits, not ==: a call with -0 may give a different result than with 0
+        case VAL_NUMV:  return memcmp(&a->as.num, &b->as.num, sizeof(double)) == 0;
+        case VAL_STRV:  return str_eq((Value *)a, (Value *)b);
+        case VAL_BOOLV: return a->as.boolval == b->as.boolval;
+        case VAL_PRIMV: return a->as.prim == b->as.prim;
+        case VAL_CLOSV: {
+            Closure *x = a->as.clos, *y = b->as.clos;
+            if (x == y) return 1;
+            if (x->body != y->body || x->capture_count != y->capture_count) return 0;
+            for (int i = 0; i < x->capture_count; i++)
+                if (!memo_equal(&x->captures[i], &y->captures[i])) return 0;
+            return 1;
+        }
+        default:
+            return 0;
+    }
+}
+
+// bytes memo_copy would take, or -1 if val can't be kept
+static long memo_size(const Value *val, int depth) {
+    if (val->type == VAL_STRV) return (long)(sizeof(String) + val->as.str->len + 1);
+    if (val->type != VAL_CLOSV) return 0;
+    if (depth == 0) return -1;
+    Closure *clos = val->as.clos;
+    long size = sizeof(Closure) + sizeof(Value) * clos->capture_count;
+    for (int i = 0; i < clos->capture_count; i++) {
+        long part = memo_size(&clos->captures[i], depth - 1);
+        if (part < 0) return -1;
+        size += part;
+    }
+    return size;
+}
+
+// val moved into the memo's arena; children before parents
+static Value memo_copy(Memo *memo, Value val) {
+    if (val.type == VAL_STRV) {
+        String *str = string_flatten(memo->arena, val.as.str);
+        return str ? (Value){VAL_STRV, {.str = str}} : errv();
+    }
+    if (val.type != VAL_CLOSV) return val;
+    Closure *old = val.as.clos;
+    Value captures[MEMO_KEY_MAX];
+    int n = old->capture_count;
+    Value *copies = n <= MEMO_KEY_MAX ? captures : malloc(sizeof(Value) * n);
+    if (!copies) return errv();
+    int ok = 1;
+    for (int i = 0; i < n && ok; i++) {
+        copies[i] = memo_copy(memo, old->captures[i]);
+        ok = copies[i].type != VAL_ERROR;
+    }
+    Closure *clos = ok ? alloc_closure(memo->arena, n) : NULL;
+    if (clos) {
+        *clos = *old;
+        memcpy(clos->captures, copies, sizeof(Value) * n);
+    }
+    if (copies != captures) free(copies);
+    return clos ? (Value){VAL_CLOSV, {.clos = clos}} : errv();
+}
+
+static void memo_unlink(Memo *memo, int e) {
+    MemoEntry *entry = &memo->entries[e];
+    if (entry->prev >= 0) memo->entries[entry->prev].next = entry->next;
+    else memo->head = entry->next;
+    if (entry->next >= 0) memo->entries[entry->next].prev = entry->prev;
+    else memo->tail = entry->prev;
+}
+
+static void memo_push_front(Memo *memo, int e) {
+    MemoEntry *entry = &memo->entries[e];
+    entry->prev = -1;
+    entry->next = memo->head;
+    if (memo->head >= 0) memo->entries[memo->head].prev = e;
+    memo->head = e;
+    if (memo->tail < 0) memo->tail = e;
+}
+
+// drop the least recently used entry; returns its index for reuse
+static int memo_evict(Memo *memo) {
+    int e = memo->tail;
+    memo_unlink(memo, e);
+    size_t i = memo->entries[e].hash & memo->mask;
+    while (memo->index[i] != e) i = (i + 1) & memo->mask;
+    // backward-shift delete: pull later entries of the probe run into the hole
+    for (size_t j = i;;) {
+        j = (j + 1) & memo->mask;
+        if (memo->index[j] < 0) break;
+        size_t home = memo->entries[memo->index[j]].hash & memo->mask;
+        if (((j - home) & memo->mask) >= ((j - i) & memo->mask)) {
+            memo->index[i] = memo->index[j];
+            i = j;
+        }
+    }
+    memo->index[i] = -1;
+    memo->evictions++;
+    return e;
+}
+
+// key value k of a call: the closure's captures, then the args
+static inline const Value *memo_key(Closure *clos, Env *frame, int k) {
+    return k < clos->capture_count ? &clos->captures[k] : &frame->slots[k - clos->capture_count];
+}
+
+// hash of a call's key, or NULL if it isn't in the table yet
+static MemoEntry *memo_find(Memo *memo, Closure *clos, Env *frame, size_t hash) {
+    int n = clos->capture_count + frame->count;
+    for (size_t i = hash & memo->mask; memo->index[i] >= 0; i = (i + 1) & memo->mask) {
+        MemoEntry *entry = &memo->entries[memo->index[i]];
+        if (entry->hash != hash || entry->body != clos->body || entry->n != n) continue;
+        int same = 1;
+        for (int k = 0; k < n && same; k++) same = memo_equal(&entry->key[k], memo_key(clos, frame, k));
+        if (same) return entry;
+    }
+    return NULL;
+}
+
+static void memo_store(Memo *memo, Closure *clos, Env *frame, size_t hash, Value result) {
+    int n = clos->capture_count + frame->count;
+    long bytes = memo_size(&result, MEMO_DEPTH);
+    for (int k = 0; k < n && bytes >= 0; k++) {
+        long part = memo_size(memo_key(clos, frame, k), MEMO_DEPTH);
+        bytes = part < 0 ? -1 : bytes + part;
+    }
+    if (bytes < 0 || memo->bytes + bytes > MEMO_BYTES_MAX) {
+        memo->refused++;
+        return;
+    }
+
+    // copy first: a copy that fails to allocate must not end up in the table
+    ArenaMark mark = arena_mark(memo->arena);
+    Value key[MEMO_KEY_MAX];
+    int ok = 1;
+    for (int k = 0; k < n && ok; k++) {
+        key[k] = memo_copy(memo, *memo_key(clos, frame, k));
+        ok = key[k].type != VAL_ERROR;
+    }
+    if (ok) result = memo_copy(memo, result);
+    if (!ok || result.type == VAL_ERROR) {
+        arena_rewind(memo->arena, mark);
+        memo->refused++;
+        return;
+    }
+    memo->bytes += bytes;
+
+    int e = memo->count < MEMO_ENTRIES ? memo->count++ : memo_evict(memo);
+    MemoEntry *entry = &memo->entries[e];
+    entry->body = clos->body;
+    entry->hash = hash;
+    entry->n = n;
+    memcpy(entry->key, key, sizeof(Value) * n);
+    entry->result = result;
+    size_t i = hash & memo->mask;
+    while (memo->index[i] >= 0) i = (i + 1) & memo->mask;
+    memo->index[i] = e;
+    memo_push_front(memo, e);
+}
+
+// a memoized closure call; the caller checks the key fits in MEMO_KEY_MAX.
+// keys with closures nested too deep are run but not looked up or stored.
+// the frame stays put while the body runs, so the key is read from it in place
+NOINLINE Value memo_call(Interp *in, Closure *clos, Env *frame) {
+    Memo *memo = in->memo;
+    int n = clos->capture_count + frame->count;
+    int ok = 1;
+    size_t hash = hash_ptr(clos->body);
+    for (int k = 0; k < n; k++) hash = hash * 31 + memo_hash(memo_key(clos, frame, k), MEMO_DEPTH, &ok);
+    hash ^= hash >> 29;     // the table indexes by the low bits
+
+    MemoEntry *entry = ok ? memo_find(memo, clos, frame, hash) : NULL;
+    if (entry) {
+        memo->hits++;
+        int e = (int)(entry - memo->entries);
+        if (memo->head != e) {
+            memo_unlink(memo, e);
+            memo_push_front(memo, e);
+        }
+        return entry->result;
+    }
+
+    if (ok) memo->misses++;
+    else memo->refused++;
+    // the body's own tail calls are part of this call, not calls to memoize
+    in->call_body = 1;
+    Value result = interp(clos->body, frame, in);
+    if (ok && result.type != VAL_ERROR) memo_store(memo, clos, frame, hash, result);
+    return result;
+}
+
+// a profiled closure call: the body and its tail calls run as a new activation.
+// with --memo too, hits count as calls
+NOINLINE Value prof_call(Interp *in, Closure *clos, Env *frame) {
+    Profile *prof = in->prof;
+    int lam = prof->lam_of[clos->body - prof->ast->nodes];
+    int site = prof_site(prof, lam, prof->stack[prof->depth - 1].site);
+    if (site < 0 || !grow_buf((void **)&prof->stack, &prof->stack_cap, prof->depth + 1, sizeof(ProfFrame)))
+        return errv();
+    prof_push(prof, lam, site, now_ms());
+    Value result;
+    if (in->memo && clos->capture_count + frame->count <= MEMO_KEY_MAX) {
+        result = memo_call(in, clos, frame);
+    } else {
+        in->call_body = 1;
+        result = interp(clos->body, frame, in);
+    }
+    prof_pop(prof, now_ms());
+    return result;
+}
+
+// (ExprC, Env) -> Value; VAL_ERROR on runtime error
+Value interp(ASTNode *node, Env *env, Interp *in) {
+    Arena *arena = in->arena;
+    const Ast *ast = in->ast;
+    // everything this call allocates, including frames of its tail calls, lands after here.
+    // there's no mutation, so older objects never point past it; only the result can
+    ArenaMark mark = arena_mark(arena);
+    // --memo, --profile: only the first closure call here is memoized or gets its
+    // own activation; the ones after it are its tail calls, and recursing for them
+    // would give up the loop below
+    int tail = 0;
+    if (in->memo || in->prof) {
+        tail = in->call_body;
+        in->call_body = 0;
+    }
+
+    // if branches and closure bodies are tail positions: loop instead of recursing
+    for (;;) {
+        if (!node) {
+            report("null AST\n");
+            return errv();
+        }
+        if (in->prof) in->prof->nodes[node->type]++;
+
+        switch (node->type) {
+            case NODE_NUMC:
+                return interp_return(arena, mark, numv(ast->nums[node->as.num]));
+
+            case NODE_STRC:
+                // the literal's String is the payload; no allocation or strlen per evaluation
+                return interp_return(arena, mark, (Value){VAL_STRV, {.str = &ast->strs[node->as.str]}});
+
+            case NODE_BOOLC:
+                return interp_return(arena, mark, boolv(node->as.bool_val));
+
+            case NODE_PRIMC:
+                return interp_return(arena, mark, interp_prim(node, env, in));
+
+            case NODE_IDC:
+                return interp_return(arena, mark, lookup(in, env, node->as.id_node.ref));
+
+            case NODE_IFC: {
+                Value test = interp(&ast->nodes[node->as.if_node.test], env, in);
+                if (test.type == VAL_ERROR) return test;
+                if (!check_type(&test, VAL_BOOLV, "if")) return errv();
+                node = &ast->nodes[test.as.boolval ? node->as.if_node.then_expr : node->as.if_node.else_expr];
+                continue;
+            }
+
+            case NODE_LAMC:
+                return interp_return(arena, mark, make_closure(arena, ast, node, env));
+
+            case NODE_APPC: {
+                const NodeId *children = ast->kids + node->as.app_node.children;
+                int n_args = node->as.app_node.child_count - 1;
+
+                Value func = interp(&ast->nodes[children[0]], env, in);
+                if (func.type == VAL_ERROR) return func;
+
+                // args are evaluated straight into the frame; for closures it becomes the
+                // call env (free variables come from the closure), for prims it is argv
+                Env *frame = alloc_env(arena, func.type == VAL_CLOSV ? func.as.clos : NULL, n_args);
+                if (!frame) return errv();
+                if (in->tasks) {
+                    if (!eval_args(children + 1, n_args, node->as.app_node.fork_mask, env, in, frame->slots))
+                        return errv();
+                } else {
+                    for (int i = 0; i < n_args; i++) {
+                        frame->slots[i] = interp(&ast->nodes[children[i + 1]], env, in);
+                        if (frame->slots[i].type == VAL_ERROR) return errv();
+                    }
+                }
+
+                if (func.type == VAL_PRIMV) {
+                    if (in->prof) prof_prim(in->prof, func.as.prim);
+                    return interp_return(arena, mark, func.as.prim(frame->slots, n_args, arena));
+                }
+                if (func.type != VAL_CLOSV) {
+                    report("cannot apply non-function\n");
+                    return errv();
+                }
+                if (func.as.clos->param_count != n_args) {
+                    report("arity mismatch: want %d, got %d\n",
+                            func.as.clos->param_count, n_args);
+                    return errv();
+                }
+
+                if (in->prof && !tail) {
+                    Value result = prof_call(in, func.as.clos, frame);
+                    return result.type == VAL_ERROR ? result : interp_return(arena, mark, result);
+                }
+                // calls with more captures and args than a key holds stay tail calls
+                if (in->memo && !tail && func.as.clos->capture_count + n_args <= MEMO_KEY_MAX) {
+                    Value result = memo_call(in, func.as.clos, frame);
+                    return result.type == VAL_ERROR ? result : interp_return(arena, mark, result);
+                }
+                if (in->prof && !prof_tail(in->prof, func.as.clos)) return errv();
+                tail = 1;
+
+                node = func.as.clos->body;
+                env = tail_frame(arena, mark, frame);
+                if (!env) return errv();
+                continue;
+            }
+        }
+
+        report("unknown node type\n");
+        return errv();
+    }
+}
+
+typedef struct {
+    char *name;
+    Value val;
+} TopBinding;
+
+// top-level env contents in slot order; resolve and make_top_env both use it
+const TopBinding top_bindings[] = {
+    {"+",         {VAL_PRIMV, {.prim = prim_add}}},
+    {"-",         {VAL_PRIMV, {.prim = prim_sub}}},
+    {"*",         {VAL_PRIMV, {.prim = prim_mul}}},
+    {"/",         {VAL_PRIMV, {.prim = prim_div}}},
+    {"<=",        {VAL_PRIMV, {.prim = prim_lte}}},
+    {"equal?",    {VAL_PRIMV, {.prim = prim_equal}}},
+    {"substring", {VAL_PRIMV, {.prim = prim_substring}}},
+    {"strlen",    {VAL_PRIMV, {.prim = prim_strlen}}},
+    {"string-append", {VAL_PRIMV, {.prim = prim_string_append}}},
+    {"error",     {VAL_PRIMV, {.prim = prim_error}}},
+    {"true",      {VAL_BOOLV, {.boolval = 1}}},
+    {"false",     {VAL_BOOLV, {.boolval = 0}}},
+};
+
+#define TOP_COUNT ((int)(sizeof(top_bindings) / sizeof(top_bindings[0])))
+
+// top-level env with primitives (+, -, *, /, <=, equal?, etc.) and true/false
+Env *make_top_env(Arena *arena) {
+    Env *env = alloc_env(arena, NULL, TOP_COUNT);
+    if (!env) return NULL;
+    for (int i = 0; i < TOP_COUNT; i++)
+        env->slots[i] = top_bindings[i].val;
+    return env;
+}
+
+// compile-time mirror of a frame: the lambda's params, plus the free variables
+// it has had to capture so far. the top-level scope has no parent
+typedef struct Scope {
+    struct Scope *parent;
+    int count;
+    char *const *names;
+    char **capture_names;   // malloc'd while resolving the body
+    VarRef *captures;
+    int capture_count, capture_cap;
+} Scope;
+
+// where name lives as seen from scope, capturing it through every lambda
+// between here and its binder; 0 if unbound
+int resolve_name(Scope *scope, char *name, VarRef *out) {
+    for (int i = 0; i < scope->count; i++) {
+        if (scope->names[i] == name) {
+            *out = (VarRef){scope->parent ? VAR_LOCAL : VAR_GLOBAL, i};
+            return 1;
+        }
+    }
+    if (!scope->parent) return 0;
+    for (int i = 0; i < scope->capture_count; i++) {
+        if (scope->capture_names[i] == name) {
+            *out = (VarRef){VAR_CAPTURED, i};
+            return 1;
+        }
+    }
+
+    VarRef outer;
+    if (!resolve_name(scope->parent, name, &outer)) return 0;
+    // globals are reachable from anywhere; no need to copy them into closures
+    if (outer.kind == VAR_GLOBAL) {
+        *out = outer;
+        return 1;
+    }
+    int need = scope->capture_count + 1;
+    if (need > scope->capture_cap) {
+        int cap = scope->capture_cap ? scope->capture_cap * 2 : 8;
+        char **names = realloc(scope->capture_names, sizeof(char *) * cap);
+        if (names) scope->capture_names = names;
+        VarRef *refs = realloc(scope->captures, sizeof(VarRef) * cap);
+        if (refs) scope->captures = refs;
+        if (!names || !refs) {
+            report("malloc failed\n");
+            return 0;
+        }
+        scope->capture_cap = cap;
+    }
+    scope->capture_names[scope->capture_count] = name;
+    scope->captures[scope->capture_count] = outer;
+    *out = (VarRef){VAR_CAPTURED, scope->capture_count++};
+    return 1;
+}
+
+// rewrite every IdC into a VarRef and give every LamC its capture list;
+// 0 and message on unbound id
+int resolve(Ast *ast, NodeId id, Scope *scope) {
+    ASTNode *node = &ast->nodes[id];
+    switch (node->type) {
+        case NODE_NUMC:
+        case NODE_STRC:
+        case NODE_BOOLC:
+            return 1;
+
+        case NODE_IDC: {
+            char *name = ast->names[node->as.id_node.name];
+            if (resolve_name(scope, name, &node->as.id_node.ref)) return 1;
+            report("unbound: %s\n", name);
+            return 0;
+        }
+
+        case NODE_IFC:
+            return resolve(ast, node->as.if_node.test, scope)
+                && resolve(ast, node->as.if_node.then_expr, scope)
+                && resolve(ast, node->as.if_node.else_expr, scope);
+
+        case NODE_LAMC: {
+            LamInfo *lam = &ast->lams[node->as.lam_node.info];
+            Scope inner = {scope, lam->param_count, ast->names + lam->params, NULL, NULL, 0, 0};
+            int ok = resolve(ast, node->as.lam_node.body, &inner);
+            int n = inner.capture_count;
+            if (ok && grow_buf((void **)&ast->refs, &ast->refs_cap, ast->n_refs + n, sizeof(VarRef))) {
+                if (n > 0) memcpy(ast->refs + ast->n_refs, inner.captures, sizeof(VarRef) * n);
+                lam->capture_count = n;
+                lam->captures = ast->n_refs;
+                ast->n_refs += n;
+            } else {
+                ok = 0;
+            }
+            free(inner.capture_names);
+            free(inner.captures);
+            return ok;
+        }
+
+        case NODE_APPC: {
+            const NodeId *children = ast->kids + node->as.app_node.children;
+            for (uint32_t i = 0; i < node->as.app_node.child_count; i++) {
+                if (!resolve(ast, children[i], scope)) return 0;
+            }
+            return 1;
+        }
+
+        case NODE_PRIMC: {
+            const NodeId *args = ast->kids + node->as.prim_node.args;
+            for (uint32_t i = 0; i < node->as.prim_node.arg_count; i++) {
+                if (!resolve(ast, args[i], scope)) return 0;
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// scope matching make_top_env's frame; names must hold TOP_COUNT entries
+Scope top_scope(SymTab *st, char **names) {
+    for (int i = 0; i < TOP_COUNT; i++)
+        names[i] = intern(st, top_bindings[i].name, strlen(top_bindings[i].name));
+    return (Scope){NULL, TOP_COUNT, names, NULL, NULL, 0, 0};
+}
+
+// top-level binding an IdC refers to, or NULL if a lambda param shadows it
+const Value *top_binding(const ASTNode *node) {
+    if (node->type != NODE_IDC || node->as.id_node.ref.kind != VAR_GLOBAL) return NULL;
+    return &top_bindings[node->as.id_node.ref.slot].val;
+}
+
+int is_const(const ASTNode *node) {
+    return node->type == NODE_NUMC || node->type == NODE_STRC || node->type == NODE_BOOLC;
+}
+
+Value const_value(const Ast *ast, const ASTNode *node) {
+    switch (node->type) {
+        case NODE_NUMC:  return numv(ast->nums[node->as.num]);
+        case NODE_STRC:  return (Value){VAL_STRV, {.str = &ast->strs[node->as.str]}};
+        case NODE_BOOLC: return boolv(node->as.bool_val);
+        default:         return errv();
+    }
+}
+
+// true if running op on these literal args can't raise an error, so it can
+// be folded without changing what a program prints
+int prim_folds(PrimOp op, Value *args) {
+    switch (op) {
+        case PRIM_ADD: case PRIM_SUB: case PRIM_MUL: case PRIM_LTE:
+            return args[0].type == VAL_NUMV && args[1].type == VAL_NUMV;
+        case PRIM_DIV:
+            return args[0].type == VAL_NUMV && args[1].type == VAL_NUMV && args[1].as.num != 0.0;
+        case PRIM_EQUAL:
+            return 1;
+        case PRIM_STRLEN:
+            return args[0].type == VAL_STRV;
+        case PRIM_APPEND:
+            return args[0].type == VAL_STRV && args[1].type == VAL_STRV;
+        case PRIM_SUBSTRING: {
+            if (args[0].type != VAL_STRV || args[1].type != VAL_NUMV || args[2].type != VAL_NUMV)
+                return 0;
+            int start = (int)args[1].as.num, stop = (int)args[2].as.num;
+            int len = (int)args[0].as.str->len;
+            return start >= 0 && start <= len && stop >= start && stop <= len;
+        }
+        default:
+            return 0;
+    }
+}
+
+// turn node into the literal for a folded result; 0 on allocation failure
+int const_node(Ast *ast, ASTNode *node, Value val) {
+    int k = 0;
+    switch (val.type) {
+        case VAL_NUMV:  k = add_num(ast, val.as.num); break;
+        case VAL_BOOLV: break;
+        case VAL_STRV:  k = add_str(ast, *val.as.str); break;
+        default: return 0;
+    }
+    if (k < 0) return 0;
+    switch (val.type) {
+        case VAL_NUMV:  node->type = NODE_NUMC;  node->as.num = k; break;
+        case VAL_BOOLV: node->type = NODE_BOOLC; node->as.bool_val = val.as.boolval; break;
+        default:        node->type = NODE_STRC;  node->as.str = k; break;
+    }
+    return 1;
+}
+
+// resolved AST -> AST with constant subexpressions folded and applications of
+// unshadowed primitives turned into PrimC; returns the node now standing for
+// id, NO_NODE on allocation failure. nodes are rewritten in place, never added
+NodeId optimize(Ast *ast, Arena *arena, NodeId id) {
+    ASTNode *node = &ast->nodes[id];
+    switch (node->type) {
+        case NODE_IDC: {
+            const Value *top = top_binding(node);
+            if (top && top->type == VAL_BOOLV) {
+                node->type = NODE_BOOLC;
+                node->as.bool_val = top->as.boolval;
+            }
+            return id;
+        }
+
+        case NODE_IFC: {
+            NodeId test = optimize(ast, arena, node->as.if_node.test);
+            NodeId then_expr = optimize(ast, arena, node->as.if_node.then_expr);
+            NodeId else_expr = optimize(ast, arena, node->as.if_node.else_expr);
+            if (test == NO_NODE || then_expr == NO_NODE || else_expr == NO_NODE) return NO_NODE;
+            if (ast->nodes[test].type == NODE_BOOLC)
+                return ast->nodes[test].as.bool_val ? then_expr : else_expr;
+            node->as.if_node.test = test;
+            node->as.if_node.then_expr = then_expr;
+            node->as.if_node.else_expr = else_expr;
+            return id;
+        }
+
+        case NODE_LAMC: {
+            NodeId body = optimize(ast, arena, node->as.lam_node.body);
+            if (body == NO_NODE) return NO_NODE;
+            node->as.lam_node.body = body;
+            return id;
+        }
+
+        case NODE_APPC: {
+            NodeId *children = ast->kids + node->as.app_node.children;
+            int n_args = node->as.app_node.child_count - 1;
+            for (int i = 0; i <= n_args; i++) {
+                children[i] = optimize(ast, arena, children[i]);
+                if (children[i] == NO_NODE) return NO_NODE;
+            }
+
+            const Value *top = top_binding(&ast->nodes[children[0]]);
+            if (!top || top->type != VAL_PRIMV) return id;
+            int op = 0;
+            while (op < PRIM_COUNT && prim_ops[op].fn != top->as.prim) op++;
+            // wrong arity stays a normal call so the primitive reports it at runtime
+            if (op == PRIM_COUNT || prim_ops[op].arity != n_args) return id;
+
+            int all_const = 1;
+            Value args[3];
+            for (int i = 0; i < n_args; i++) {
+                const ASTNode *arg = &ast->nodes[children[i + 1]];
+                all_const = all_const && is_const(arg);
+                args[i] = const_value(ast, arg);
+                // literal headers live in ast->strs, which moves as folds add to
+                // it; a folded rope must point at copies
+                if (args[i].type == VAL_STRV) {
+                    args[i].as.str = arena_dup(arena, args[i].as.str, sizeof(String), ALLOC_AST);
+                    if (!args[i].as.str) return NO_NODE;
+                }
+            }
+            if (all_const && prim_folds(op, args)) {
+                Value folded = prim_ops[op].fn(args, n_args, arena);
+                if (folded.type == VAL_ERROR || !const_node(ast, node, folded)) return NO_NODE;
+                return id;
+            }
+
+            // reuse the node: children[1..] become the primitive's args
+            uint32_t first = node->as.app_node.children;
+            node->type = NODE_PRIMC;
+            node->op = op;
+            node->as.prim_node.args = first + 1;
+            node->as.prim_node.arg_count = n_args;
+            return id;
+        }
+
+        default:
+            return id;
+    }
+}
+
+int mark_forks(Ast *ast, NodeId id);
+
+// args worth forking: those that call a closure somewhere, when at least two
+// do. everything else (constants, lookups, primitive arithmetic, building
+// closures) costs less than a fork. *calls says whether any arg calls
+static unsigned fork_mask(Ast *ast, const NodeId *args, int n, int *calls) {
+    unsigned mask = 0;
+    int heavy = 0;
+    for (int i = 0; i < n; i++) {
+        if (!mark_forks(ast, args[i])) continue;
+        heavy++;
+        if (i < FORK_MAX) mask |= 1u << i;
+    }
+    *calls = heavy > 0;
+    return heavy >= 2 ? mask : 0;
+}
+
+// fill in fork masks for --parallel; returns whether node can make a call
+int mark_forks(Ast *ast, NodeId id) {
+    ASTNode *node = &ast->nodes[id];
+    int calls;
+    switch (node->type) {
+        case NODE_IFC: {
+            int test = mark_forks(ast, node->as.if_node.test);
+            int then_expr = mark_forks(ast, node->as.if_node.then_expr);
+            int else_expr = mark_forks(ast, node->as.if_node.else_expr);
+            return test || then_expr || else_expr;
+        }
+        case NODE_LAMC:
+            mark_forks(ast, node->as.lam_node.body);
+            return 0;
+        case NODE_APPC: {
+            const NodeId *children = ast->kids + node->as.app_node.children;
+            mark_forks(ast, children[0]);
+            node->as.app_node.fork_mask = fork_mask(ast, children + 1,
+                                                    node->as.app_node.child_count - 1, &calls);
+            return 1;
+        }
+        case NODE_PRIMC:
+            node->as.prim_node.fork_mask = fork_mask(ast, ast->kids + node->as.prim_node.args,
+                                                     node->as.prim_node.arg_count, &calls);
+            return calls;
+        default:
+            return 0;
+    }
+}
+
+// bytecode for the --vm engine. operands follow the opcode as extra words
+#define OPCODES(X) \
+    X(OP_CONST)          /* k: push consts[k] */ \
+    X(OP_LOCAL)          /* s: push param s of the current frame */ \
+    X(OP_CAPTURED)       /* s: push free variable s of the running closure */ \
+    X(OP_TOP)            /* s: push slot s of the top-level frame */ \
+    X(OP_JUMP)           /* t: continue at t */ \
+    X(OP_JUMP_IF_FALSE)  /* t: pop a boolean, continue at t if false */ \
+    X(OP_CLOSURE)        /* p: push closure over protos[p], copying its free variables */ \
+    X(OP_CALL)           /* n: apply the value under the top n to them */ \
+    X(OP_TAIL_CALL)      /* n: same, reusing the current call frame */ \
+    X(OP_RETURN)         \
+    X(OP_ADD)            /* unshadowed binary primitives, inline */ \
+    X(OP_SUB)            \
+    X(OP_MUL)            \
+    X(OP_DIV)            \
+    X(OP_LTE)            \
+    X(OP_ADD_LK)         /* s k: push local s + consts[k], i.e. {+ x 1} */ \
+    X(OP_SUB_LK)         /* s k: push local s - consts[k] */ \
+    X(OP_LTE_LK)         /* s k: push local s <= consts[k] */ \
+    X(OP_BRANCH_LTE_LK)  /* s k t: continue at t unless local s <= consts[k] */
+
+#define OP_ENUM(name) name,
+typedef enum { OPCODES(OP_ENUM) OP_COUNT } Opcode;
+
+// compiled lambda body (or the whole program, with no params)
+typedef struct Proto {
+    uint32_t *code;
+    int code_len;
+    Value *consts;
+    struct Proto **protos;  // nested lambdas, indexed by OP_CLOSURE
+    int param_count;
+    int capture_count;      // free variables OP_CLOSURE copies, as in LamInfo
+    const VarRef *captures;
+    int max_stack;          // operand slots the body needs
+} Proto;
+
+typedef struct {
+    Arena *arena;
+    const Ast *ast;
+    uint32_t *code;         // malloc'd while building, copied into the arena when done
+    int len, cap;
+    Value *consts;
+    int n_consts, consts_cap;
+    Proto **protos;
+    int n_protos, protos_cap;
+    int depth, max_depth;   // operand stack height while emitting
+} Compiler;
+
+
+// append op and its operands; stack_effect tracks the operand height
+int emit(Compiler *c, int stack_effect, int n_words, const uint32_t *words) {
+    if (!grow_buf((void **)&c->code, &c->cap, c->len + n_words, sizeof(uint32_t))) return 0;
+    memcpy(c->code + c->len, words, sizeof(uint32_t) * n_words);
+    c->len += n_words;
+    c->depth += stack_effect;
+    if (c->depth > c->max_depth) c->max_depth = c->depth;
+    return 1;
+}
+
+#define EMIT(c, effect, ...) \
+    emit(c, effect, sizeof((uint32_t[]){__VA_ARGS__}) / sizeof(uint32_t), (uint32_t[]){__VA_ARGS__})
+
+int add_const(Compiler *c, Value val) {
+    if (!grow_buf((void **)&c->consts, &c->consts_cap, c->n_consts + 1, sizeof(Value))) return -1;
+    c->consts[c->n_consts] = val;
+    return c->n_consts++;
+}
+
+int local_slot(const ASTNode *node) {
+    return node->type == NODE_IDC && node->as.id_node.ref.kind == VAR_LOCAL ? node->as.id_node.ref.slot : -1;
+}
+
+// PrimC of op with a local on the left and a number literal on the right
+int is_prim_lk(const Ast *ast, const ASTNode *node, PrimOp op) {
+    if (node->type != NODE_PRIMC || node->op != op) return 0;
+    const NodeId *args = ast->kids + node->as.prim_node.args;
+    return local_slot(&ast->nodes[args[0]]) >= 0 && ast->nodes[args[1]].type == NODE_NUMC;
+}
+
+Proto *compile_proto(Arena *arena, const Ast *ast, ASTNode *body, int param_count);
+int compile_node(Compiler *c, ASTNode *node, int tail);
+
+int compile_prim(Compiler *c, ASTNode *node, int tail) {
+    const Ast *ast = c->ast;
+    PrimOp op = node->op;
+    const NodeId *args = ast->kids + node->as.prim_node.args;
+    int n_args = node->as.prim_node.arg_count;
+    static const Opcode binops[] = {
+        [PRIM_ADD] = OP_ADD, [PRIM_SUB] = OP_SUB, [PRIM_MUL] = OP_MUL,
+        [PRIM_DIV] = OP_DIV, [PRIM_LTE] = OP_LTE
+    };
+    static const Opcode lk_ops[] = {
+        [PRIM_ADD] = OP_ADD_LK, [PRIM_SUB] = OP_SUB_LK, [PRIM_LTE] = OP_LTE_LK
+    };
+
+    if (op <= PRIM_LTE) {
+        int ok;
+        // {op local number} shapes get one superinstruction
+        if (op != PRIM_MUL && op != PRIM_DIV && is_prim_lk(ast, node, op)) {
+            int k = add_const(c, const_value(ast, &ast->nodes[args[1]]));
+            ok = k >= 0 && EMIT(c, 1, lk_ops[op], local_slot(&ast->nodes[args[0]]), k);
+        } else {
+            ok = compile_node(c, &ast->nodes[args[0]], 0) && compile_node(c, &ast->nodes[args[1]], 0)
+                && EMIT(c, -1, binops[op]);
+        }
+        return ok && (!tail || EMIT(c, -1, OP_RETURN));
+    }
+
+    // the rest go through the primitive as a regular call
+    int k = add_const(c, (Value){VAL_PRIMV, {.prim = prim_ops[op].fn}});
+    if (k < 0 || !EMIT(c, 1, OP_CONST, k)) return 0;
+    for (int i = 0; i < n_args; i++) {
+        if (!compile_node(c, &ast->nodes[args[i]], 0)) return 0;
+    }
+    if (tail) return EMIT(c, -(n_args + 1), OP_TAIL_CALL, n_args);
+    return EMIT(c, -n_args, OP_CALL, n_args);
+}
+
+int compile_app(Compiler *c, ASTNode *node, int tail) {
+    const NodeId *children = c->ast->kids + node->as.app_node.children;
+    int n_args = node->as.app_node.child_count - 1;
+
+    for (int i = 0; i <= n_args; i++) {
+        if (!compile_node(c, &c->ast->nodes[children[i]], 0)) return 0;
+    }
+    if (tail) return EMIT(c, -(n_args + 1), OP_TAIL_CALL, n_args);
+    return EMIT(c, -n_args, OP_CALL, n_args);
+}
+
+int compile_if(Compiler *c, ASTNode *node, int tail) {
+    const Ast *ast = c->ast;
+    ASTNode *test = &ast->nodes[node->as.if_node.test];
+    int patch;
+
+    // {if {<= x 1} ...}: compare and branch in one instruction
+    if (is_prim_lk(ast, test, PRIM_LTE)) {
+        const NodeId *args = ast->kids + test->as.prim_node.args;
+        int k = add_const(c, const_value(ast, &ast->nodes[args[1]]));
+        if (k < 0 || !EMIT(c, 0, OP_BRANCH_LTE_LK, local_slot(&ast->nodes[args[0]]), k, 0)) return 0;
+    } else {
+        if (!compile_node(c, test, 0) || !EMIT(c, -1, OP_JUMP_IF_FALSE, 0)) return 0;
+    }
+    patch = c->len - 1;
+
+    int depth = c->depth;
+    if (!compile_node(c, &ast->nodes[node->as.if_node.then_expr], tail)) return 0;
+    int jump_patch = -1;
+    if (!tail) {
+        if (!EMIT(c, 0, OP_JUMP, 0)) return 0;
+        jump_patch = c->len - 1;
+    }
+    c->code[patch] = c->len;
+    c->depth = depth;
+    if (!compile_node(c, &ast->nodes[node->as.if_node.else_expr], tail)) return 0;
+    if (jump_patch >= 0) c->code[jump_patch] = c->len;
+    return 1;
+}
+
+// emit code leaving node's value on the stack; in tail position, return it instead
+int compile_node(Compiler *c, ASTNode *node, int tail) {
+    int ok;
+    switch (node->type) {
+        case NODE_NUMC:
+        case NODE_STRC:
+        case NODE_BOOLC: {
+            int k = add_const(c, const_value(c->ast, node));
+            ok = k >= 0 && EMIT(c, 1, OP_CONST, k);
+            break;
+        }
+        case NODE_IDC: {
+            static const Opcode load_ops[] = {
+                [VAR_LOCAL] = OP_LOCAL, [VAR_CAPTURED] = OP_CAPTURED, [VAR_GLOBAL] = OP_TOP
+            };
+            VarRef ref = node->as.id_node.ref;
+            ok = EMIT(c, 1, load_ops[ref.kind], ref.slot);
+            break;
+        }
+        case NODE_IFC:
+            return compile_if(c, node, tail);
+        case NODE_LAMC: {
+            const LamInfo *lam = &c->ast->lams[node->as.lam_node.info];
+            Proto *proto = compile_proto(c->arena, c->ast, &c->ast->nodes[node->as.lam_node.body],
+                                         lam->param_count);
+            if (!proto) return 0;
+            proto->capture_count = lam->capture_count;
+            proto->captures = c->ast->refs + lam->captures;
+            if (!grow_buf((void **)&c->protos, &c->protos_cap, c->n_protos + 1, sizeof(Proto *))) return 0;
+            c->protos[c->n_protos] = proto;
+            ok = EMIT(c, 1, OP_CLOSURE, c->n_protos++);
+            break;
+        }
+        case NODE_APPC:
+            return compile_app(c, node, tail);
+        case NODE_PRIMC:
+            return compile_prim(c, node, tail);
+        default:
+            report("unknown node type\n");
+            return 0;
+    }
+    return ok && (!tail || EMIT(c, -1, OP_RETURN));
+}
+
+// body -> Proto whose code returns its value; NULL on error
+Proto *compile_proto(Arena *arena, const Ast *ast, ASTNode *body, int param_count) {
+    Compiler c = {0};
+    c.arena = arena;
+    c.ast = ast;
+    Proto *proto = NULL;
+
+    if (!compile_node(&c, body, 1)) goto done;
+    proto = arena_alloc(arena, sizeof(Proto), ALLOC_CODE);
+    if (!proto) goto done;
+    proto->code = arena_dup(arena, c.code, sizeof(uint32_t) * c.len, ALLOC_CODE);
+    proto->consts = arena_dup(arena, c.consts, sizeof(Value) * c.n_consts, ALLOC_CODE);
+    proto->protos = arena_dup(arena, c.protos, sizeof(Proto *) * c.n_protos, ALLOC_CODE);
+    if (!proto->code || !proto->consts || !proto->protos) proto = NULL;
+    else {
+        proto->code_len = c.len;
+        proto->param_count = param_count;
+        proto->capture_count = 0;
+        proto->captures = NULL;
+        proto->max_stack = c.max_depth;
+    }
+
+done:
+    free(c.code);
+    free(c.consts);
+    free(c.protos);
+    return proto;
+}
+
+// params stay on the operand stack where the caller pushed them: base[0] is
+// the callee, base[1..n] the args, and the callee's operands start above those
+typedef struct {
+    Proto *proto;
+    const uint32_t *ip;     // saved resume point while a callee runs
+    Closure *clos;          // running closure, for OP_CAPTURED; NULL at top level
+    Value *base;            // where the callee sat; its result lands here
+    ArenaMark mark;         // arena position when the call started
+} CallFrame;
+
+// copying collector for the VM's runtime heap (--gc). closures and strings made
+// while running go into from, an arena of their own; once it outgrows limit,
+// everything reachable from the VM stack is copied into to and the two swap.
+// the VM is the only engine with precise roots: the tree walker keeps live
+// values in C locals of its recursive interp calls
+typedef struct {
+    Arena *from, *to;
+    ArenaMark from_base, to_base;   // the empty position of each
+    size_t limit;           // from-space bytes that trigger the next collection
+    ArenaChunk *seen;       // from's head at the last check; only recount on change
+    int verbose;            // --gc-stats: report on exit
+    // per collection, malloc'd
+    const unsigned char **ranges;   // sorted [start, end) pairs of from's chunks
+    int n_ranges, ranges_cap;
+    const void **fwd;       // open-addressed old -> new map, 2 entries per slot
+    size_t fwd_cap, fwd_count;
+    Value **work;           // copied closures whose captures still need forwarding
+    int n_work, work_cap;
+    // report
+    int collections;
+    size_t live, peak;
+    double pause_total, pause_max;
+} Heap;
+
+#define GC_CHUNK_SIZE (256 * 1024)
+#define GC_MIN_LIMIT (4 * 1024 * 1024)
+
+Heap *heap_create(int verbose) {
+    Heap *gc = calloc(1, sizeof(Heap));
+    if (!gc) {
+        report("malloc failed\n");
+        return NULL;
+    }
+    gc->from = arena_create(GC_CHUNK_SIZE, 0);
+    gc->to = arena_create(GC_CHUNK_SIZE, 0);
+    if (!gc->from || !gc->to) {
+        arena_destroy(gc->from);
+        arena_destroy(gc->to);
+        free(gc);
+        return NULL;
+    }
+    gc->from_base = arena_mark(gc->from);
+    gc->to_base = arena_mark(gc->to);
+    gc->limit = GC_MIN_LIMIT;
+    gc->verbose = verbose;
+    return gc;
+}
+
+// drop everything the last program left in the heap; statistics carry on
+void heap_reset(Heap *gc) {
+    size_t size = arena_size(gc->from);
+    if (size > gc->peak) gc->peak = size;
+    arena_rewind(gc->from, gc->from_base);
+    gc->limit = GC_MIN_LIMIT;
+    gc->seen = NULL;
+}
+
+void heap_destroy(Heap *gc) {
+    if (!gc) return;
+    if (gc->verbose) {
+        size_t size = arena_size(gc->from);
+        if (size > gc->peak) gc->peak = size;
+        fprintf(stderr, "SHEQ: gc: %d collections, pause %.3f ms total, %.3f ms max, "
+                "%zu bytes live, %zu bytes peak heap\n",
+                gc->collections, gc->pause_total, gc->pause_max, gc->live, gc->peak);
+    }
+    arena_destroy(gc->from);
+    arena_destroy(gc->to);
+    free(gc->ranges);
+    free(gc->fwd);
+    free(gc->work);
+    free(gc);
+}
+
+// cheap enough to ask at every call: only walks the chunks after a new one was linked
+static inline int gc_due(Heap *gc) {
+    if (gc->from->head == gc->seen) return 0;
+    gc->seen = gc->from->head;
+    return arena_size(gc->from) >= gc->limit;
+}
+
+int cmp_range(const void *a, const void *b) {
+    const unsigned char *x = *(const unsigned char *const *)a, *y = *(const unsigned char *const *)b;
+    return x < y ? -1 : x > y;
+}
+
+// true if ptr lies in from-space, i.e. has to move
+int gc_in_from(Heap *gc, const void *ptr) {
+    const unsigned char *p = ptr;
+    int lo = 0, hi = gc->n_ranges;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (p < gc->ranges[2 * mid]) hi = mid;
+        else if (p >= gc->ranges[2 * mid + 1]) lo = mid + 1;
+        else return 1;
+    }
+    return 0;
+}
+
+// new address of an already copied object, or NULL
+void *gc_forwarded(Heap *gc, const void *old) {
+    if (!gc->fwd_count) return NULL;
+    size_t mask = gc->fwd_cap - 1;
+    for (size_t i = hash_ptr(old) & mask; gc->fwd[2 * i]; i = (i + 1) & mask) {
+        if (gc->fwd[2 * i] == old) return (void *)gc->fwd[2 * i + 1];
+    }
+    return NULL;
+}
+
+int gc_forward_to(Heap *gc, const void *old, const void *moved) {
+    if (2 * (gc->fwd_count + 1) > gc->fwd_cap) {
+        size_t cap = gc->fwd_cap ? gc->fwd_cap * 2 : 1024;
+        const void **grown = calloc(2 * cap, sizeof(void *));
+        if (!grown) {
+            report("malloc failed\n");
+            return 0;
+        }
+        for (size_t j = 0; j < gc->fwd_cap; j++) {
+            if (!gc->fwd[2 * j]) continue;
+            size_t i = hash_ptr(gc->fwd[2 * j]) & (cap - 1);
+            while (grown[2 * i]) i = (i + 1) & (cap - 1);
+            grown[2 * i] = gc->fwd[2 * j];
+            grown[2 * i + 1] = gc->fwd[2 * j + 1];
+        }
+        free(gc->fwd);
+        gc->fwd = grown;
+        gc->fwd_cap = cap;
+    }
+    size_t mask = gc->fwd_cap - 1;
+    size_t i = hash_ptr(old) & mask;
+    while (gc->fwd[2 * i]) i = (i + 1) & mask;
+    gc->fwd[2 * i] = old;
+    gc->fwd[2 * i + 1] = moved;
+    gc->fwd_count++;
+    return 1;
+}
+
+// point *slot at to-space, copying what it refers to on first sight; 0 on failure
+int gc_forward(Heap *gc, Value *slot) {
+    void *old;
+    if (slot->type == VAL_STRV) old = slot->as.str;
+    else if (slot->type == VAL_CLOSV) old = slot->as.clos;
+    else return 1;
+    if (!gc_in_from(gc, old)) return 1;
+
+    void *moved = gc_forwarded(gc, old);
+    if (!moved) {
+        if (slot->type == VAL_STRV) {
+            String *str = old;
+            // ropes come out flat, so shared pieces are copied once per rope
+            if (str->depth > 0 || gc_in_from(gc, str->data)) {
+                moved = string_flatten(gc->to, str);
+                if (!moved) return 0;
+            } else {
+                moved = arena_dup(gc->to, str, sizeof(String), ALLOC_STRING);
+                if (!moved) return 0;
+            }
+        } else {
+            Closure *clos = old;
+            size_t size = sizeof(Closure) + sizeof(Value) * clos->capture_count;
+            Closure *copy = arena_dup(gc->to, clos, size, ALLOC_CLOSURE);
+            if (!copy) return 0;
+            // captures are forwarded later from the work list, not recursively
+            if (copy->capture_count > 0) {
+                if (!grow_buf((void **)&gc->work, &gc->work_cap, gc->n_work + 1, sizeof(Value *)))
+                    return 0;
+                gc->work[gc->n_work++] = copy->captures;
+            }
+            moved = copy;
+        }
+        if (!gc_forward_to(gc, old, moved)) return 0;
+    }
+    if (slot->type == VAL_STRV) slot->as.str = moved;
+    else slot->as.clos = moved;
+    return 1;
+}
+
+// copy everything reachable from [stack, sp) into to-space, then swap spaces.
+// frame marks are reset to the new top: everything surviving counts as older
+// than every live frame, which keeps the VM's rewind-on-return sound
+int gc_collect(Heap *gc, Value *stack, Value *sp, CallFrame *frames, int fp) {
+    double start = now_ms();
+    size_t before = arena_size(gc->from);
+
+    gc->n_ranges = 0;
+    for (ArenaChunk *chunk = gc->from->head; chunk; chunk = chunk->prev) {
+        if (!grow_buf((void **)&gc->ranges, &gc->ranges_cap, 2 * gc->n_ranges + 2, sizeof(void *)))
+            return 0;
+        gc->ranges[2 * gc->n_ranges] = chunk->data;
+        gc->ranges[2 * gc->n_ranges + 1] = chunk->data + chunk->used;
+        gc->n_ranges++;
+    }
+    qsort(gc->ranges, gc->n_ranges, 2 * sizeof(void *), cmp_range);
+    if (gc->fwd) memset(gc->fwd, 0, 2 * gc->fwd_cap * sizeof(void *));
+    gc->fwd_count = 0;
+    gc->n_work = 0;
+
+    for (Value *slot = stack; slot < sp; slot++) {
+        if (!gc_forward(gc, slot)) return 0;
+    }
+    while (gc->n_work > 0) {
+        Value *captures = gc->work[--gc->n_work];
+        Closure *clos = (Closure *)((char *)captures - offsetof(Closure, captures));
+        for (int i = 0; i < clos->capture_count; i++) {
+            if (!gc_forward(gc, &captures[i])) return 0;
+        }
+    }
+
+    // old from-space is garbage now; hand its memory back instead of keeping spares
+    arena_rewind(gc->from, gc->from_base);
+    chunk_list_destroy(gc->from->spare);
+    gc->from->spare = NULL;
+    Arena *swap = gc->from;
+    gc->from = gc->to;
+    gc->to = swap;
+    ArenaMark base = gc->from_base;
+    gc->from_base = gc->to_base;
+    gc->to_base = base;
+
+    ArenaMark top = arena_mark(gc->from);
+    for (int i = 0; i <= fp; i++) {
+        frames[i].mark = top;
+        if (i > 0) frames[i].clos = frames[i].base->as.clos;
+    }
+    gc->live = arena_size(gc->from);
+    if (before > gc->peak) gc->peak = before;
+    // leave room to grow: collect again once the heap doubles its survivors
+    gc->limit = gc->live * 2 > GC_MIN_LIMIT ? gc->live * 2 : GC_MIN_LIMIT;
+    gc->seen = gc->from->head;
+
+    double pause = now_ms() - start;
+    gc->collections++;
+    gc->pause_total += pause;
+    if (pause > gc->pause_max) gc->pause_max = pause;
+    return 1;
+}
+
+#define VM_STACK_MAX (1 << 20)
+#define VM_FRAMES_MAX (1 << 18)
+
+// fast path for inline arithmetic; falls back to the PrimFn for type errors
+#define VM_BINOP(expr_type, field, expr, ok)                                    \
+    do {                                                                        \
+        Value *lhs = sp - 2, *rhs = sp - 1;                                     \
+        if (lhs->type == VAL_NUMV && rhs->type == VAL_NUMV) {                   \
+            double a = lhs->as.num, b = rhs->as.num;                            \
+            if (ok) {                                                           \
+                lhs->type = expr_type;                                          \
+                lhs->as.field = expr;                                           \
+                sp--;                                                           \
+                DISPATCH();                                                     \
+            }                                                                   \
+        }                                                                       \
+        goto prim_fallback;                                                     \
+    } while (0)
+
+#define VM_BINOP_LK(expr_type, field, expr)                                     \
+    do {                                                                        \
+        Value *lhs = &locals[ip[0]];                                            \
+        const Value *rhs = &consts[ip[1]];                                      \
+        ip += 2;                                                                \
+        if (lhs->type == VAL_NUMV) {                                            \
+            double a = lhs->as.num, b = rhs->as.num;                            \
+            sp->type = expr_type;                                               \
+            sp->as.field = expr;                                                \
+            sp++;                                                               \
+            DISPATCH();                                                         \
+        }                                                                       \
+        sp[0] = *lhs;                                                           \
+        sp[1] = *rhs;                                                           \
+        sp += 2;                                                                \
+        goto prim_fallback;                                                     \
+    } while (0)
+
+#if defined(__GNUC__) && !defined(SHEQ_SWITCH_DISPATCH)
+#define VM_COMPUTED_GOTO 1
+// labels-as-values is a GNU extension; keep -pedantic quiet for the dispatch loop
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+#ifdef VM_COMPUTED_GOTO
+#define CASE(op) L_##op:
+#define DISPATCH() goto *dispatch[*ip++]
+#else
+#define CASE(op) case op:
+#define DISPATCH() goto next
+#endif
+
+// operand stack and call frames, allocated once and reused by every vm_run
+typedef struct {
+    Value *stack;
+    CallFrame *frames;
+} VMStack;
+
+VMStack *vm_stack_create(void) {
+    VMStack *vs = malloc(sizeof(VMStack));
+    if (vs) {
+        vs->stack = malloc(sizeof(Value) * VM_STACK_MAX);
+        vs->frames = malloc(sizeof(CallFrame) * VM_FRAMES_MAX);
+        if (vs->stack && vs->frames) return vs;
+        free(vs->stack);
+        free(vs->frames);
+        free(vs);
+    }
+    report("malloc failed\n");
+    return NULL;
+}
+
+void vm_stack_destroy(VMStack *vs) {
+    if (!vs) return;
+    free(vs->stack);
+    free(vs->frames);
+    free(vs);
+}
+
+// run a compiled program against the top-level env; VAL_ERROR on runtime error.
+// with gc, runtime objects go into its heap instead of arena
+Value vm_run(Proto *program, Env *top, Arena *arena, Heap *gc, VMStack *vs) {
+#ifdef VM_COMPUTED_GOTO
+#define OP_LABEL(name) &&L_##name,
+    static void *dispatch[] = { OPCODES(OP_LABEL) };
+#endif
+    Value *stack = vs->stack;
+    CallFrame *frames = vs->frames;
+    Value result = errv();
+
+    if (gc) arena = gc->from;
+    int fp = 0;
+    stack[0] = errv();
+    // slot 0 stands in for the callee, so the top level looks like any other frame
+    frames[0] = (CallFrame){program, NULL, NULL, stack, arena_mark(arena)};
+    const uint32_t *ip = program->code;
+    const Value *consts = program->consts;
+    Value *locals = stack + 1;
+    Closure *clos = NULL;
+    Value *sp = stack + 1;
+    PrimFn prim = NULL;     // primitive behind the op that fell back to a call
+
+#ifdef VM_COMPUTED_GOTO
+    DISPATCH();
+#else
+next:
+    switch (*ip++) {
+#endif
+
+    CASE(OP_CONST)
+        *sp++ = consts[*ip++];
+        DISPATCH();
+
+    CASE(OP_LOCAL)
+        *sp++ = locals[*ip++];
+        DISPATCH();
+
+    CASE(OP_CAPTURED)
+        *sp++ = clos->captures[*ip++];
+        DISPATCH();
+
+    CASE(OP_TOP)
+        *sp++ = top->slots[*ip++];
+        DISPATCH();
+
+    CASE(OP_JUMP)
+        ip = frames[fp].proto->code + *ip;
+        DISPATCH();
+
+    CASE(OP_JUMP_IF_FALSE) {
+        Value *test = --sp;
+        if (!check_type(test, VAL_BOOLV, "if")) goto done;
+        if (!test->as.boolval) ip = frames[fp].proto->code + *ip;
+        else ip++;
+        DISPATCH();
+    }
+
+    CASE(OP_CLOSURE) {
+        Proto *proto = frames[fp].proto->protos[*ip++];
+        Closure *made = alloc_closure(arena, proto->capture_count);
+        if (!made) goto done;
+        made->param_count = proto->param_count;
+        made->capture_count = proto->capture_count;
+        made->body = NULL;
+        made->proto = proto;
+        for (int i = 0; i < proto->capture_count; i++) {
+            VarRef ref = proto->captures[i];
+            made->captures[i] = ref.kind == VAR_LOCAL ? locals[ref.slot] : clos->captures[ref.slot];
+        }
+        *sp++ = (Value){VAL_CLOSV, {.clos = made}};
+        DISPATCH();
+    }
+
+    CASE(OP_CALL)
+    CASE(OP_TAIL_CALL) {
+        // safe point: every live value is on the stack
+        if (gc && gc_due(gc)) {
+            if (!gc_collect(gc, stack, sp, frames, fp)) goto done;
+            arena = gc->from;
+            clos = frames[fp].clos;
+        }
+        int tail = ip[-1] == OP_TAIL_CALL;
+        int n_args = *ip++;
+        Value *callee = sp - n_args - 1;
+
+        if (callee->type == VAL_PRIMV) {
+            *callee = callee->as.prim(callee + 1, n_args, arena);
+            if (callee->type == VAL_ERROR) goto done;
+            sp = callee + 1;
+            if (tail) goto do_return;
+            DISPATCH();
+        }
+        if (callee->type != VAL_CLOSV) {
+            report("cannot apply non-function\n");
+            goto done;
+        }
+        if (callee->as.clos->param_count != n_args) {
+            report("arity mismatch: want %d, got %d\n",
+                    callee->as.clos->param_count, n_args);
+            goto done;
+        }
+        Proto *proto = callee->as.clos->proto;
+
+        CallFrame *frame;
+        if (tail) {
+            // reuse this frame, sliding callee and args down over it; drop its
+            // temporaries too unless one of them still points into them
+            frame = &frames[fp];
+            int escapes = value_escapes(arena, frame->mark, callee);
+            for (int i = 1; i <= n_args && !escapes; i++)
+                escapes = value_escapes(arena, frame->mark, &callee[i]);
+            if (!escapes) arena_rewind(arena, frame->mark);
+            memmove(frame->base, callee, sizeof(Value) * (n_args + 1));
+        } else {
+            if (fp + 1 >= VM_FRAMES_MAX) {
+                report("stack overflow\n");
+                goto done;
+            }
+            frames[fp].ip = ip;
+            frame = &frames[++fp];
+            frame->base = callee;
+            frame->mark = arena_mark(arena);
+        }
+        if (frame->base + n_args + proto->max_stack + 1 >= stack + VM_STACK_MAX) {
+            report("stack overflow\n");
+            goto done;
+        }
+
+        clos = frame->base->as.clos;
+        frame->proto = proto;
+        frame->clos = clos;
+        locals = frame->base + 1;
+        consts = proto->consts;
+        ip = proto->code;
+        sp = locals + n_args;
+        DISPATCH();
+    }
+
+    CASE(OP_RETURN)
+    do_return: {
+        Value ret = sp[-1];
+        CallFrame *frame = &frames[fp];
+        // nothing older points into this call's memory, so unless the result does it's garbage
+        if (!value_escapes(arena, frame->mark, &ret)) arena_rewind(arena, frame->mark);
+        if (fp == 0) {
+            result = ret;
+            goto done;
+        }
+        *frame->base = ret;
+        sp = frame->base + 1;
+        frame = &frames[--fp];
+        ip = frame->ip;
+        clos = frame->clos;
+        locals = frame->base + 1;
+        consts = frame->proto->consts;
+        DISPATCH();
+    }
+
+    CASE(OP_ADD) prim = prim_add; VM_BINOP(VAL_NUMV, num, a + b, 1);
+    CASE(OP_SUB) prim = prim_sub; VM_BINOP(VAL_NUMV, num, a - b, 1);
+    CASE(OP_MUL) prim = prim_mul; VM_BINOP(VAL_NUMV, num, a * b, 1);
+    CASE(OP_DIV) prim = prim_div; VM_BINOP(VAL_NUMV, num, a / b, b != 0.0);
+    CASE(OP_LTE) prim = prim_lte; VM_BINOP(VAL_BOOLV, boolval, a <= b, 1);
+
+    CASE(OP_ADD_LK) prim = prim_add; VM_BINOP_LK(VAL_NUMV, num, a + b);
+    CASE(OP_SUB_LK) prim = prim_sub; VM_BINOP_LK(VAL_NUMV, num, a - b);
+    CASE(OP_LTE_LK) prim = prim_lte; VM_BINOP_LK(VAL_BOOLV, boolval, a <= b);
+
+    CASE(OP_BRANCH_LTE_LK) {
+        Value *lhs = &locals[ip[0]];
+        if (lhs->type != VAL_NUMV) {
+            sp[0] = *lhs;
+            sp[1] = consts[ip[1]];
+            sp += 2;
+            prim = prim_lte;
+            goto prim_fallback;
+        }
+        if (lhs->as.num <= consts[ip[1]].as.num) ip += 3;
+        else ip = frames[fp].proto->code + ip[2];
+        DISPATCH();
+    }
+
+#ifndef VM_COMPUTED_GOTO
+    default:
+        report("bad opcode\n");
+        goto done;
+    }
+#endif
+
+prim_fallback: {
+        // only reached when the inline fast path would misbehave: let the
+        // primitive report the error (or compute the edge case) the normal way
+        sp[-2] = prim(sp - 2, 2, arena);
+        if (sp[-2].type == VAL_ERROR) goto done;
+        sp--;
+        DISPATCH();
+    }
+
+done:
+    return result;
+}
+
+#ifdef VM_COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
+
+// --profile: report, and the folded-stack file, go out when the run ends
+Profile *prof_create(const char *folded) {
+    Profile *prof = calloc(1, sizeof(Profile));
+    if (!prof) {
+        report("malloc failed\n");
+        return NULL;
+    }
+    prof->folded = folded;
+    return prof;
+}
+
+void prof_destroy(Profile *prof) {
+    if (!prof) return;
+    free(prof->lam_of);
+    free(prof->lams);
+    free(prof->stack);
+    free(prof->sites);
+    free(prof);
+}
+
+// start profiling a run of ast, counting bytes allocated from arena; the top
+// level is the first activation
+int prof_begin(Profile *prof, const Ast *ast, Arena *arena) {
+    prof->ast = ast;
+    prof->arena = arena;
+    prof->n_lams = ast->n_lams + 1;
+    prof->lam_of = malloc(sizeof(int) * (ast->n_nodes ? ast->n_nodes : 1));
+    prof->lams = calloc(prof->n_lams, sizeof(ProfLambda));
+    if (!prof->lam_of || !prof->lams
+        || !grow_buf((void **)&prof->stack, &prof->stack_cap, 1, sizeof(ProfFrame))) {
+        report("malloc failed\n");
+        return 0;
+    }
+    for (int i = 0; i < ast->n_nodes; i++) {
+        const ASTNode *node = &ast->nodes[i];
+        if (node->type == NODE_LAMC) prof->lam_of[node->as.lam_node.body] = node->as.lam_node.info;
+    }
+    int site = prof_site(prof, ast->n_lams, -1);
+    if (site < 0) return 0;
+    prof_push(prof, ast->n_lams, site, now_ms());
+    return 1;
+}
+
+static void prof_name(const Profile *prof, int lam, char *buf, size_t size) {
+    if (lam == prof->n_lams - 1) snprintf(buf, size, "<top>");
+    else snprintf(buf, size, "lambda@%d:%d", prof->ast->lams[lam].line, prof->ast->lams[lam].col);
+}
+
+// one line per site: the lambdas from the top down, then its exclusive microseconds
+static void prof_fold(const Profile *prof, FILE *out, int site, char *path, size_t len, size_t cap) {
+    const ProfSite *s = &prof->sites[site];
+    char name[32];
+    prof_name(prof, s->lam, name, sizeof(name));
+    int n = snprintf(path + len, cap - len, "%s%s", len ? ";" : "", name);
+    if (n < 0 || (size_t)n >= cap - len) return;    // too deep to print; so are its children
+    len += n;
+    long long us = (long long)(s->self_ms * 1000 + 0.5);
+    if (us > 0) fprintf(out, "%s %lld\n", path, us);
+    for (int c = s->child; c >= 0; c = prof->sites[c].next) prof_fold(prof, out, c, path, len, cap);
+}
+
+static const Profile *prof_sorting;
+
+static int prof_by_excl(const void *a, const void *b) {
+    const ProfLambda *x = &prof_sorting->lams[*(const int *)a], *y = &prof_sorting->lams[*(const int *)b];
+    return (x->excl_ms < y->excl_ms) - (x->excl_ms > y->excl_ms);
+}
+
+// end the top level's activation, then print the report to stderr; 0 if the
+// folded stacks could not be written
+int prof_end(Profile *prof) {
+    static const char *const node_names[] = {
+        "NumC", "StrC", "IdC", "IfC", "LamC", "AppC", "BoolC", "PrimC"
+    };
+    prof_pop(prof, now_ms());
+    const ProfLambda *top = &prof->lams[prof->n_lams - 1];
+    uint64_t nodes = 0, calls = 0;
+    for (int t = 0; t <= NODE_PRIMC; t++) nodes += prof->nodes[t];
+    for (int l = 0; l < prof->n_lams - 1; l++) calls += prof->lams[l].calls;
+    fprintf(stderr, "SHEQ: profile: %.3f ms, %llu nodes evaluated, %llu closure calls, "
+            "%llu bytes allocated\n", top->incl_ms, (unsigned long long)nodes,
+            (unsigned long long)calls, (unsigned long long)top->incl_bytes);
+
+    fprintf(stderr, "  nodes:");
+    for (int t = 0; t <= NODE_PRIMC; t++)
+        if (prof->nodes[t]) fprintf(stderr, "  %s %llu", node_names[t], (unsigned long long)prof->nodes[t]);
+    fprintf(stderr, "\n  prims:");
+    for (int i = 0; i < PROF_PRIMS && prof->prims[i].fn; i++) {
+        const char *name = "?";
+        for (int b = 0; b < TOP_COUNT; b++)
+            if (top_bindings[b].val.type == VAL_PRIMV && top_bindings[b].val.as.prim == prof->prims[i].fn)
+                name = top_bindings[b].name;
+        fprintf(stderr, "  %s %llu", name, (unsigned long long)prof->prims[i].calls);
+    }
+    fprintf(stderr, "\n");
+
+    // lambdas that ran, most exclusive time first
+    int *order = malloc(sizeof(int) * prof->n_lams);
+    if (order) {
+        int n = 0;
+        for (int l = 0; l < prof->n_lams; l++)
+            if (prof->lams[l].calls) order[n++] = l;
+        prof_sorting = prof;
+        qsort(order, n, sizeof(int), prof_by_excl);
+        fprintf(stderr, "  %10s %11s %11s %12s %12s  %s\n",
+                "calls", "excl ms", "incl ms", "excl bytes", "incl bytes", "lambda");
+        for (int i = 0; i < n; i++) {
+            const ProfLambda *lam = &prof->lams[order[i]];
+            char name[32];
+            prof_name(prof, order[i], name, sizeof(name));
+            fprintf(stderr, "  %10llu %11.3f %11.3f %12llu %12llu  %s\n", (unsigned long long)lam->calls,
+                    lam->excl_ms, lam->incl_ms, (unsigned long long)lam->excl_bytes,
+                    (unsigned long long)lam->incl_bytes, name);
+        }
+        free(order);
+    }
+
+    if (!prof->folded) return 1;
+    FILE *out = fopen(prof->folded, "w");
+    if (!out) {
+        report("cannot open '%s': %s\n", prof->folded, strerror(errno));
+        return 0;
+    }
+    char path[4096];
+    prof_fold(prof, out, 0, path, 0, sizeof(path));
+    if (fclose(out) != 0) {
+        report("cannot write '%s': %s\n", prof->folded, strerror(errno));
+        return 0;
+    }
+    return 1;
+}
+
+// command-line settings threaded from main into top_interp
+typedef struct {
+    int arena_flags;
+    int use_vm;             // --vm: compile to bytecode instead of walking the AST
+    int gc;                 // --gc: collect the VM's runtime heap; 2 with --gc-stats
+    int batch;              // BATCH_LINES or BATCH_FRAMED: many programs, one process
+    const char *socket_path;    // --socket: serve batches on a Unix socket
+    int jobs;               // --jobs: batch worker threads
+    int parallel;           // --parallel: threads for forked args in the tree walker
+    int memo;               // --memo: cache closure results; 2 with --memo-stats
+    const char *compile_to; // --compile-to: write the program as an image instead of running it
+    const char *load;       // --load: run an image instead of source
+    int profile;            // --profile: report where a run's time and memory go
+    const char *profile_folded; // --profile-folded: also write folded stacks here
+    int stats;              // --stats: report memory by subsystem on exit
+} Options;
+
+enum {
+    BATCH_LINES = 1,        // --batch: one program per line
+    BATCH_FRAMED = 2        // --framed: "<byte count>\n<program>" frames
+};
+
+// --stats: memory by subsystem over every program a context runs
+typedef struct {
+    ArenaStats arena;       // frames, closures, strings and bytecode
+    ArenaStats names;       // the symbol table's interned identifiers
+    ArenaStats memo;        // --memo: copies of keys and results
+    size_t programs;
+    size_t tokens;          // lexed; the parser holds one at a time, so they cost no memory
+    int max_nodes;          // the largest program's tree
+    size_t max_ast_bytes;
+} Stats;
+
+static void arena_stats_print(const char *name, const ArenaStats *stats) {
+    static const char *const kind_names[ALLOC_KINDS] = {
+        "env", "closure", "string", "ast", "code", "name"
+    };
+    size_t bytes = 0, count = 0;
+    for (int k = 0; k < ALLOC_KINDS; k++) {
+        bytes += stats->bytes[k];
+        count += stats->count[k];
+    }
+    fprintf(stderr, "  %s: %zu bytes in %zu allocations, high water %zu, padding %zu, "
+            "chunk tails %zu, %zu chunks of %zu bytes\n", name, bytes, count, stats->high_water,
+            stats->padding, stats->chunk_tails, stats->chunks, stats->chunk_bytes);
+    for (int k = 0; k < ALLOC_KINDS; k++) {
+        if (stats->count[k])
+            fprintf(stderr, "    %-8s %12zu bytes %10zu allocations\n", kind_names[k],
+                    stats->bytes[k], stats->count[k]);
+    }
+}
+
+void stats_print(const Stats *stats, int memo) {
+    fprintf(stderr, "SHEQ: stats: %zu program%s, %zu tokens, largest AST %d nodes in %zu bytes\n",
+            stats->programs, stats->programs == 1 ? "" : "s", stats->tokens, stats->max_nodes,
+            stats->max_ast_bytes);
+    arena_stats_print("arena", &stats->arena);
+    arena_stats_print("names", &stats->names);
+    if (memo) arena_stats_print("memo", &stats->memo);
+}
+
+// everything a run needs besides the program itself. batch mode builds it once
+// and rewinds to mark after each program
+typedef struct {
+    const Options *opts;
+    Arena *arena;
+    SymTab *st;
+    char *top_names[TOP_COUNT];
+    Env *top;
+    ArenaMark mark;         // arena position after setup
+    Heap *gc;
+    VMStack *vm;
+    TaskPool *tasks;
+    Memo *memo;
+    Profile *prof;
+    Stats *stats;           // --stats; NULL otherwise
+    Ast ast;                // the current program; reset, not freed, between programs
+    OutBuf text;            // the last result, serialized; kept for its capacity
+} Context;
+
+// interned names kept across batch programs before the table is rebuilt
+#define BATCH_SYMTAB_MAX (1 << 16)
+
+int context_init(Context *ctx, const Options *opts) {
+    *ctx = (Context){0};
+    ctx->opts = opts;
+    // 1MB chunks; the arena links more as deep recursion needs them
+    ctx->arena = arena_create(1024 * 1024, opts->arena_flags);
+    ctx->st = symtab_create();
+    if (!ctx->arena || !ctx->st) return 0;
+    if (opts->stats) {
+        if (!(ctx->stats = calloc(1, sizeof(Stats)))) {
+            report("malloc failed\n");
+            return 0;
+        }
+        arena_track(ctx->arena, &ctx->stats->arena);
+        arena_track(ctx->st->strings, &ctx->stats->names);
+    }
+    top_scope(ctx->st, ctx->top_names);
+    ctx->top = make_top_env(ctx->arena);
+    if (!ctx->top) return 0;
+    if (opts->use_vm && !(ctx->vm = vm_stack_create())) return 0;
+    if (opts->gc && !(ctx->gc = heap_create(opts->gc > 1))) return 0;
+    if (opts->memo && !(ctx->memo = memo_create(opts->memo > 1))) return 0;
+    if (ctx->memo && ctx->stats) arena_track(ctx->memo->arena, &ctx->stats->memo);
+    if (opts->profile && !(ctx->prof = prof_create(opts->profile_folded))) return 0;
+    if (opts->parallel && !(ctx->tasks = task_pool_create(opts->parallel, ctx->top->slots))) return 0;
+    ctx->mark = arena_mark(ctx->arena);
+    return 1;
+}
+
+void context_destroy(Context *ctx) {
+    if (ctx->stats) {
+        stats_print(ctx->stats, ctx->memo != NULL);
+        free(ctx->stats);
+    }
+    free(ctx->text.data);
+    ast_free(&ctx->ast);
+    memo_destroy(ctx->memo);
+    prof_destroy(ctx->prof);
+    task_pool_destroy(ctx->tasks);
+    heap_destroy(ctx->gc);
+    vm_stack_destroy(ctx->vm);
+    symtab_destroy(ctx->st);
+    arena_destroy(ctx->arena);
+}
+
+// parse, resolve and optimize src into ctx->ast; its root, or NO_NODE after
+// an error
+NodeId context_compile(Context *ctx, const char *src, int len) {
+    Ast *ast = &ctx->ast;
+    ast_reset(ast);
+    Parser parser = parser_init(ast, ctx->st, src, len);
+    NodeId root = parse_expr(&parser);
+    int parsed = root != NO_NODE && parser_finish(&parser);
+    if (ctx->stats) ctx->stats->tokens += parser.tokens;
+    parser_free(&parser);
+    if (!parsed) return NO_NODE;
+
+    Scope scope = {NULL, TOP_COUNT, ctx->top_names, NULL, NULL, 0, 0};
+    if (!resolve(ast, root, &scope)) return NO_NODE;
+    root = optimize(ast, ctx->arena, root);
+    if (root != NO_NODE && ctx->tasks) mark_forks(ast, root);
+    return root;
+}
+
+// evaluate the program at root and print its result line to out; returns 0
+// on success. ast is ctx->ast or a loaded image
+int context_run(Context *ctx, const Ast *ast, NodeId root, FILE *out) {
+    Arena *arena = ctx->arena;
+    Value val;
+    if (ctx->stats) {
+        ctx->stats->programs++;
+        if (ast->n_nodes > ctx->stats->max_nodes) {
+            ctx->stats->max_nodes = ast->n_nodes;
+            ctx->stats->max_ast_bytes = ast_bytes(ast);
+        }
+    }
+    if (ctx->opts->use_vm) {
+        Proto *program = compile_proto(arena, ast, &ast->nodes[root], 0);
+        if (!program) return 1;
+        val = vm_run(program, ctx->top, arena, ctx->gc, ctx->vm);
+    } else {
+        Interp in = {ast, arena, ctx->top->slots, ctx->tasks, ctx->memo, ctx->prof, 0};
+        if (ctx->prof && !prof_begin(ctx->prof, ast, arena)) return 1;
+        val = interp(&ast->nodes[root], ctx->top, &in);
+        if (ctx->prof && !prof_end(ctx->prof)) return 1;
+    }
+    if (val.type == VAL_ERROR) return 1;
+
+    ctx->text.len = 0;
+    if (!serialize(&ctx->text, &val) || !out_append(&ctx->text, "\n", 1)) return 1;
+    fwrite(ctx->text.data, 1, ctx->text.len, out);
+    return 0;
+}
+
+// drop everything the last program left behind
+void context_reset(Context *ctx) {
+    arena_rewind(ctx->arena, ctx->mark);
+    if (ctx->gc) heap_reset(ctx->gc);
+    if (ctx->memo) memo_reset(ctx->memo);
+    // names from old programs are dead once their ASTs are gone
+    if (ctx->st->count > BATCH_SYMTAB_MAX) {
+        SymTab *st = symtab_create();
+        if (st) {
+            symtab_destroy(ctx->st);
+            ctx->st = st;
+            if (ctx->stats) {
+                ctx->stats->names.live = 0;
+                arena_track(st->strings, &ctx->stats->names);
+            }
+            top_scope(st, ctx->top_names);
+        }
+    }
+}
+
+// evaluate one program and print its result line to out; returns 0 on success.
+// leaves the context as it found it
+int context_eval(Context *ctx, const char *src, int len, FILE *out) {
+    NodeId root = context_compile(ctx, src, len);
+    int status = root == NO_NODE ? 1 : context_run(ctx, &ctx->ast, root, out);
+    context_reset(ctx);
+    return status;
+}
+
+// source text -> prints serialized result; returns 0 on success
+int top_interp(const char *src, int len, const Options *opts) {
+    Context ctx;
+    int status = 1;
+    if (context_init(&ctx, opts)) status = context_eval(&ctx, src, len, stdout);
+    context_destroy(&ctx);
+    return status;
+}
+
+// --compile-to writes the resolved, optimized AST as an image: a header and
+// then the Ast's arrays exactly as they sit in memory, each 8-byte aligned.
+// nodes only hold indices, so --load maps the file and points the Ast straight
+// at it; only string literals get headers built, one per literal. the layout
+// is this build's own, and the header pins what it depends on. image_load
+// checks section sizes, then image_check every index the nodes hold
+#define IMAGE_MAGIC "SHEQ4IMG"
+#define IMAGE_VERSION 2
+
+typedef struct {
+    char magic[8];
+    uint64_t text_len;      // literal bytes, after the other sections
+    uint32_t version;
+    uint32_t node_size;     // sizeof(ASTNode)
+    uint32_t top_count;     // global slots index top_bindings
+    uint32_t prim_count;    // PrimC ops index prim_ops
+    uint32_t root;
+    uint32_t n_nodes, n_kids, n_nums, n_strs, n_lams, n_refs;
+    uint32_t pad;           // keeps the sections 8-byte aligned
+} ImageHeader;
+
+// a literal: where its bytes sit in the text section
+typedef struct {
+    uint64_t offset, len;
+} ImageStr;
+
+enum { IMG_NUMS, IMG_NODES, IMG_KIDS, IMG_LAMS, IMG_REFS, IMG_STRS, IMG_TEXT, IMG_SECTIONS };
+
+// each section's file offset and byte length; returns the image's total size
+static size_t image_layout(const ImageHeader *h, size_t off[IMG_SECTIONS], size_t len[IMG_SECTIONS]) {
+    len[IMG_NUMS] = sizeof(double) * h->n_nums;
+    len[IMG_NODES] = sizeof(ASTNode) * h->n_nodes;
+    len[IMG_KIDS] = sizeof(NodeId) * h->n_kids;
+    len[IMG_LAMS] = sizeof(LamInfo) * h->n_lams;
+    len[IMG_REFS] = sizeof(VarRef) * h->n_refs;
+    len[IMG_STRS] = sizeof(ImageStr) * h->n_strs;
+    len[IMG_TEXT] = h->text_len;
+    size_t pos = sizeof(ImageHeader);
+    for (int i = 0; i < IMG_SECTIONS; i++) {
+        off[i] = pos;
+        pos = (pos + len[i] + 7) & ~(size_t)7;
+    }
+    return pos;
+}
+
+// ast rooted at root -> image file at path; 0 and message on failure
+int image_write(const char *path, const Ast *ast, NodeId root) {
+    ImageHeader h = {IMAGE_MAGIC, 0, IMAGE_VERSION, sizeof(ASTNode), TOP_COUNT, PRIM_COUNT, root,
+                     ast->n_nodes, ast->n_kids, ast->n_nums, ast->n_strs, ast->n_lams, ast->n_refs, 0};
+    ImageStr *strs = malloc(sizeof(ImageStr) * (ast->n_strs ? ast->n_strs : 1));
+    if (!strs) {
+        report("malloc failed\n");
+        return 0;
+    }
+    for (int i = 0; i < ast->n_strs; i++) {
+        strs[i] = (ImageStr){h.text_len, ast->strs[i].len};
+        h.text_len += ast->strs[i].len;
+    }
+    size_t off[IMG_SECTIONS], len[IMG_SECTIONS];
+    size_t size = image_layout(&h, off, len);
+
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        report("cannot write '%s': %s\n", path, strerror(errno));
+        free(strs);
+        return 0;
+    }
+    // sections are placed by seeking, so the padding between them reads as zeros
+    const void *arrays[IMG_TEXT] = {ast->nums, ast->nodes, ast->kids, ast->lams, ast->refs, strs};
+    int ok = fwrite(&h, sizeof(h), 1, f) == 1;
+    for (int i = 0; i < IMG_TEXT && ok; i++)
+        ok = !len[i] || (fseek(f, (long)off[i], SEEK_SET) == 0 && fwrite(arrays[i], 1, len[i], f) == len[i]);
+    // folded strings may be ropes or views; they're written out flat
+    ok = ok && fseek(f, (long)off[IMG_TEXT], SEEK_SET) == 0;
+    for (int i = 0; i < ast->n_strs && ok; i++) {
+        StrCursor cur;
+        cursor_init(&cur, &ast->strs[i]);
+        for (const String *piece; ok && (piece = cursor_next(&cur));)
+            ok = fwrite(piece->data, 1, piece->len, f) == piece->len;
+    }
+    ok = ok && fflush(f) == 0 && ftruncate(fileno(f), (off_t)size) == 0;
+    if (fclose(f) != 0) ok = 0;
+    if (!ok) report("cannot write '%s': %s\n", path, strerror(errno));
+    free(strs);
+    return ok;
+}
+
+// a program loaded by --load: ast's arrays point into the mapping
+typedef struct {
+    Ast ast;
+    NodeId root;
+    void *map;
+    size_t map_len;
+} Image;
+
+// resolved variable valid in the frame of lambda lam (-1: top level)
+static int image_ref_ok(const Ast *ast, VarRef ref, int lam) {
+    if (ref.slot < 0) return 0;
+    switch (ref.kind) {
+        case VAR_GLOBAL:   return ref.slot < TOP_COUNT;
+        case VAR_LOCAL:    return lam >= 0 && ref.slot < ast->lams[lam].param_count;
+        case VAR_CAPTURED: return lam >= 0 && ref.slot < ast->lams[lam].capture_count;
+        default:           return 0;
+    }
+}
+
+// every index a loaded program holds is in range, and the nodes reachable from
+// root form a tree, as the parser builds them: each has one parent, with a lower
+// id, so walking it is linear and a crafted image can't make the engines redo
+// shared subtrees. variables fit the frame of their enclosing lambda. nodes
+// optimize left unreachable only get their indices checked. one pass from the
+// last node down sees each node's parent, and so its enclosing lambda, first
+static int image_check(const Ast *ast, NodeId root) {
+    for (int l = 0; l < ast->n_lams; l++) {
+        const LamInfo *lam = &ast->lams[l];
+        if (lam->param_count < 0 || lam->capture_count < 0 || lam->captures < 0
+            || (int64_t)lam->captures + lam->capture_count > ast->n_refs)
+            return 0;
+    }
+    // per node: enclosing lambda, -1 at top level, -2 if not reached from root
+    int *scope = malloc(sizeof(int) * (ast->n_nodes ? ast->n_nodes : 1));
+    if (!scope) {
+        report("malloc failed\n");
+        return 0;
+    }
+    for (int i = 0; i < ast->n_nodes; i++) scope[i] = -2;
+    scope[root] = -1;
+
+    int ok = 1;
+    for (int64_t id = (int64_t)ast->n_nodes - 1; id >= 0 && ok; id--) {
+        const ASTNode *node = &ast->nodes[id];
+        int here = scope[id], inner = here;
+        NodeId kids[3];
+        const NodeId *list = kids;
+        int64_t n = 0;
+        switch (node->type) {
+            case NODE_NUMC:  ok = node->as.num < (uint32_t)ast->n_nums; break;
+            case NODE_STRC:  ok = node->as.str < (uint32_t)ast->n_strs; break;
+            case NODE_BOOLC: break;
+            case NODE_IDC:
+                ok = here == -2 || image_ref_ok(ast, node->as.id_node.ref, here);
+                break;
+            case NODE_IFC:
+                kids[0] = node->as.if_node.test;
+                kids[1] = node->as.if_node.then_expr;
+                kids[2] = node->as.if_node.else_expr;
+                n = 3;
+                break;
+            case NODE_LAMC: {
+                uint32_t info = node->as.lam_node.info;
+                ok = info < (uint32_t)ast->n_lams;
+                if (!ok) break;
+                const LamInfo *lam = &ast->lams[info];
+                for (int c = 0; c < lam->capture_count && ok && here != -2; c++)
+                    ok = image_ref_ok(ast, ast->refs[lam->captures + c], here);
+                kids[0] = node->as.lam_node.body;
+                n = 1;
+                if (here != -2) inner = (int)info;
+                break;
+            }
+            case NODE_APPC:
+                list = ast->kids + node->as.app_node.children;
+                n = node->as.app_node.child_count;
+                ok = n >= 1 && node->as.app_node.children + n <= ast->n_kids;
+                break;
+            case NODE_PRIMC:
+                list = ast->kids + node->as.prim_node.args;
+                n = node->as.prim_node.arg_count;
+                ok = node->op < PRIM_COUNT && n == prim_ops[node->op].arity
+                    && node->as.prim_node.args + n <= ast->n_kids;
+                break;
+            default:
+                ok = 0;
+        }
+        for (int64_t k = 0; k < n && ok; k++) {
+            NodeId child = list[k];
+            ok = child < id;
+            if (!ok || here == -2) continue;
+            ok = scope[child] == -2;    // a second parent, or root as a child
+            scope[child] = inner;
+        }
+    }
+    free(scope);
+    return ok;
+}
+
+// map the image at path; 0 and message if it can't be used
+int image_load(Image *img, const char *path) {
+    *img = (Image){0};
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        report("cannot open '%s': %s\n", path, strerror(errno));
+        return 0;
+    }
+    struct stat sb;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size >= (off_t)sizeof(ImageHeader))
+        map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        report("'%s' is not a program image\n", path);
+        return 0;
+    }
+    img->map = map;
+    img->map_len = sb.st_size;
+
+    const ImageHeader *h = map;
+    size_t off[IMG_SECTIONS], len[IMG_SECTIONS];
+    if (memcmp(h->magic, IMAGE_MAGIC, sizeof(h->magic)) != 0 || h->version != IMAGE_VERSION) {
+        report("'%s' is not a program image\n", path);
+        return 0;
+    }
+    if (h->node_size != sizeof(ASTNode) || h->top_count != TOP_COUNT || h->prim_count != PRIM_COUNT) {
+        report("'%s' was compiled by a different build\n", path);
+        return 0;
+    }
+    if (h->text_len > img->map_len || image_layout(h, off, len) != img->map_len
+        || h->root >= h->n_nodes || h->n_strs > INT_MAX) {
+        report("'%s' is truncated or corrupt\n", path);
+        return 0;
+    }
+
+    char *base = map;
+    Ast *ast = &img->ast;
+    ast->nums = (double *)(base + off[IMG_NUMS]);
+    ast->nodes = (ASTNode *)(base + off[IMG_NODES]);
+    ast->kids = (NodeId *)(base + off[IMG_KIDS]);
+    ast->lams = (LamInfo *)(base + off[IMG_LAMS]);
+    ast->refs = (VarRef *)(base + off[IMG_REFS]);
+    ast->n_nums = h->n_nums;
+    ast->n_nodes = h->n_nodes;
+    ast->n_kids = h->n_kids;
+    ast->n_lams = h->n_lams;
+    ast->n_refs = h->n_refs;
+    img->root = h->root;
+
+    // literal values are String headers, which hold pointers
+    const ImageStr *strs = (const ImageStr *)(base + off[IMG_STRS]);
+    char *text = base + off[IMG_TEXT];
+    ast->strs = malloc(sizeof(String) * (h->n_strs ? h->n_strs : 1));
+    if (!ast->strs) {
+        report("malloc failed\n");
+        return 0;
+    }
+    for (uint32_t i = 0; i < h->n_strs; i++) {
+        if (strs[i].offset > h->text_len || strs[i].len > h->text_len - strs[i].offset) {
+            report("'%s' is truncated or corrupt\n", path);
+            return 0;
+        }
+        ast->strs[i] = (String){strs[i].len, 0, {.data = text + strs[i].offset}};
+    }
+    ast->n_strs = h->n_strs;
+    if (!image_check(ast, img->root)) {
+        report("'%s' is truncated or corrupt\n", path);
+        return 0;
+    }
+    return 1;
+}
+
+void image_close(Image *img) {
+    free(img->ast.strs);
+    if (img->map) munmap(img->map, img->map_len);
+}
+
+// --compile-to: source text -> image at path; returns 0 on success
+int compile_image(const char *src, int len, const Options *opts, const char *path) {
+    Context ctx;
+    int status = 1;
+    if (context_init(&ctx, opts)) {
+        NodeId root = context_compile(&ctx, src, len);
+        // fork masks cost nothing without --parallel, so images always carry them
+        if (root != NO_NODE) {
+            mark_forks(&ctx.ast, root);
+            status = !image_write(path, &ctx.ast, root);
+        }
+        context_reset(&ctx);
+    }
+    context_destroy(&ctx);
+    return status;
+}
+
+// --load: evaluate the image at path; returns 0 on success
+int run_image(const char *path, const Options *opts) {
+    Context ctx;
+    Image img = {0};
+    int status = 1;
+    if (context_init(&ctx, opts) && image_load(&img, path)) {
+        status = context_run(&ctx, &img.ast, img.root, stdout);
+        context_reset(&ctx);
+    }
+    image_close(&img);
+    context_destroy(&ctx);
+    return status;
+}
+
+// next program from in: a line (without its newline), or one length-prefixed
+// frame; -1 at end of input, -2 on a malformed frame
+long batch_next(FILE *in, int framed, char **buf, size_t *cap) {
+    if (!framed) {
+        ssize_t got = getline(buf, cap, in);
+        if (got < 0) return -1;
+        if (got > 0 && (*buf)[got - 1] == '\n') got--;
+        return got;
+    }
+    int c = fgetc(in);
+    if (c == EOF) return -1;
+    ungetc(c, in);
+    long len;
+    if (fscanf(in, "%ld", &len) != 1 || len < 0 || fgetc(in) != '\n') return -2;
+    if ((size_t)len + 1 > *cap) {
+        char *grown = realloc(*buf, len + 1);
+        if (!grown) return -2;
+        *buf = grown;
+        *cap = len + 1;
+    }
+    if (fread(*buf, 1, len, in) != (size_t)len) return -2;
+    return len;
+}
+
+// one batch program's result line, or its error line, to out
+void batch_eval(Context *ctx, const char *src, long len, FILE *out) {
+    char msg[REPORT_MAX];
+    msg[0] = '\0';
+    report_buf = msg;
+    int status = len > INT_MAX ? 1 : context_eval(ctx, src, (int)len, out);
+    report_buf = NULL;
+    if (status != 0) fprintf(out, "SHEQ: %s\n", msg[0] ? msg : "program too large");
+}
+
+// batch mode: one result line per program on out, in input order. errors
+// become "SHEQ: message" lines instead of going to stderr
+void run_batch(Context *ctx, FILE *in, FILE *out) {
+    char *buf = NULL;
+    size_t cap = 0;
+    long len;
+    while ((len = batch_next(in, ctx->opts->batch == BATCH_FRAMED, &buf, &cap)) >= 0) {
+        batch_eval(ctx, buf, len, out);
+        // a client may be waiting on this answer before sending the next program
+        fflush(out);
+    }
+    // the stream is out of step with the framing; nothing after this is usable
+    if (len == -2) fprintf(out, "SHEQ: malformed frame\n");
+    free(buf);
+}
+
+// --jobs: batch input is read in rounds, and each round's programs are spread
+// over worker threads, each with a Context of its own. a worker starts with a
+// contiguous share of the round in a Chase-Lev deque, pops its own work from the
+// bottom, and once empty steals from the top of the others'. nothing is pushed
+// mid-round, so a deque is just a range of program indices
+typedef struct {
+    _Atomic long top, bottom;
+} Deque;
+
+// owner end; -1 when empty
+long deque_pop(Deque *dq) {
+    long b = atomic_load_explicit(&dq->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&dq->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long t = atomic_load_explicit(&dq->top, memory_order_relaxed);
+    if (t > b) {
+        atomic_store_explicit(&dq->bottom, b + 1, memory_order_relaxed);
+        return -1;
+    }
+    if (t == b) {
+        // last one: race the thieves for it
+        if (!atomic_compare_exchange_strong_explicit(&dq->top, &t, t + 1,
+                memory_order_seq_cst, memory_order_relaxed))
+            b = -1;
+        atomic_store_explicit(&dq->bottom, t + 1, memory_order_relaxed);
+    }
+    return b;
+}
+
+// thief end; -1 when empty, -2 when another thread got there first
+long deque_steal(Deque *dq) {
+    long t = atomic_load_explicit(&dq->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = atomic_load_explicit(&dq->bottom, memory_order_acquire);
+    if (t >= b) return -1;
+    if (!atomic_compare_exchange_strong_explicit(&dq->top, &t, t + 1,
+            memory_order_seq_cst, memory_order_relaxed))
+        return -2;
+    return t;
+}
+
+#define JOBS_MAX 256
+
+// programs per round, and round text that ends one early
+#define ROUND_PROGRAMS 16384
+#define ROUND_BYTES (4 * 1024 * 1024)
+
+typedef struct Pool Pool;
+
+typedef struct {
+    Pool *pool;
+    Context ctx;
+    Deque dq;
+    pthread_t thread;
+    FILE *out;              // this round's result lines, in the order run
+    char *text;
+    size_t text_len;
+} Worker;
+
+struct Pool {
+    Worker *workers;
+    int n;
+    // the current round
+    char *text;             // program text, back to back
+    size_t text_len, text_cap;
+    size_t *starts;         // program i is text[starts[i] .. starts[i + 1])
+    int count;
+    int *owner;             // worker that ran program i
+    long *out_start, *out_end;  // where its result line sits in that worker's text
+};
+
+long next_task(Worker *self) {
+    long i = deque_pop(&self->dq);
+    if (i >= 0) return i;
+    Pool *pool = self->pool;
+    int idx = (int)(self - pool->workers);
+    for (int k = 1; k < pool->n; k++) {
+        Deque *victim = &pool->workers[(idx + k) % pool->n].dq;
+        while ((i = deque_steal(victim)) == -2) {}
+        if (i >= 0) return i;
+    }
+    return -1;
+}
+
+void *worker_run(void *arg) {
+    Worker *self = arg;
+    Pool *pool = self->pool;
+    long i;
+    while ((i = next_task(self)) >= 0) {
+        pool->owner[i] = (int)(self - pool->workers);
+        pool->out_start[i] = ftell(self->out);
+        batch_eval(&self->ctx, pool->text + pool->starts[i],
+                   (long)(pool->starts[i + 1] - pool->starts[i]), self->out);
+        pool->out_end[i] = ftell(self->out);
+    }
+    return NULL;
+}
+
+// run the round's programs on all workers, then write the results in input order
+int run_round(Pool *pool, FILE *out) {
+    int per = pool->count / pool->n, extra = pool->count % pool->n;
+    long next = 0;
+    int started = 0, ok = 1;
+    for (int w = 0; w < pool->n; w++) {
+        Worker *wk = &pool->workers[w];
+        long share = per + (w < extra);
+        atomic_store(&wk->dq.top, next);
+        atomic_store(&wk->dq.bottom, next + share);
+        next += share;
+        wk->text = NULL;
+        wk->out = open_memstream(&wk->text, &wk->text_len);
+        if (!wk->out) ok = 0;
+    }
+    // if some threads can't start, the ones running steal their shares
+    for (int w = 0; ok && w < pool->n; w++)
+        if (pthread_create(&pool->workers[w].thread, NULL, worker_run, &pool->workers[w]) == 0)
+            started++;
+    for (int w = 0; w < started; w++) pthread_join(pool->workers[w].thread, NULL);
+    for (int w = 0; w < pool->n; w++)
+        if (pool->workers[w].out) fclose(pool->workers[w].out);
+    if (!ok || started == 0) report("cannot start batch workers\n");
+    else {
+        for (int i = 0; i < pool->count; i++) {
+            Worker *wk = &pool->workers[pool->owner[i]];
+            fwrite(wk->text + pool->out_start[i], 1, pool->out_end[i] - pool->out_start[i], out);
+        }
+        fflush(out);
+    }
+    for (int w = 0; w < pool->n; w++) free(pool->workers[w].text);
+    pool->count = 0;
+    pool->text_len = 0;
+    return ok && started > 0;
+}
+
+// add a program to the round being read
+int round_add(Pool *pool, const char *src, long len) {
+    if (pool->text_len + len > pool->text_cap) {
+        size_t cap = pool->text_cap ? pool->text_cap : 64 * 1024;
+        while (cap < pool->text_len + len) cap *= 2;
+        char *grown = realloc(pool->text, cap);
+        if (!grown) {
+            report("malloc failed\n");
+            return 0;
+        }
+        pool->text = grown;
+        pool->text_cap = cap;
+    }
+    memcpy(pool->text + pool->text_len, src, len);
+    pool->text_len += len;
+    pool->starts[++pool->count] = pool->text_len;
+    return 1;
+}
+
+// batch mode over opts->jobs threads; answers come a round at a time
+int run_batch_parallel(const Options *opts, FILE *in, FILE *out) {
+    Pool pool = {0};
+    int status = 1;
+    pool.n = opts->jobs;
+    pool.workers = calloc(pool.n, sizeof(Worker));
+    pool.starts = malloc(sizeof(size_t) * (ROUND_PROGRAMS + 1));
+    pool.owner = malloc(sizeof(int) * ROUND_PROGRAMS);
+    pool.out_start = malloc(sizeof(long) * ROUND_PROGRAMS);
+    pool.out_end = malloc(sizeof(long) * ROUND_PROGRAMS);
+    int ready = 0;
+    if (pool.workers && pool.starts && pool.owner && pool.out_start && pool.out_end) {
+        for (ready = 0; ready < pool.n; ready++) {
+            pool.workers[ready].pool = &pool;
+            if (!context_init(&pool.workers[ready].ctx, opts)) {
+                context_destroy(&pool.workers[ready].ctx);
+                break;
+            }
+        }
+    } else {
+        report("malloc failed\n");
+    }
+
+    if (ready == pool.n) {
+        char *buf = NULL;
+        size_t cap = 0;
+        long len = 0;
+        pool.starts[0] = 0;
+        status = 0;
+        while (status == 0 && len >= 0) {
+            while (pool.count < ROUND_PROGRAMS && pool.text_len < ROUND_BYTES &&
+                   (len = batch_next(in, opts->batch == BATCH_FRAMED, &buf, &cap)) >= 0) {
+                if (!round_add(&pool, buf, len)) {
+                    status = 1;
+                    break;
+                }
+            }
+            if (status == 0 && pool.count > 0 && !run_round(&pool, out)) status = 1;
+        }
+        if (len == -2) fprintf(out, "SHEQ: malformed frame\n");
+        free(buf);
+    }
+
+    for (int w = 0; w < ready; w++) context_destroy(&pool.workers[w].ctx);
+    free(pool.workers);
+    free(pool.text);
+    free(pool.starts);
+    free(pool.owner);
+    free(pool.out_start);
+    free(pool.out_end);
+    return status;
+}
+
+// --socket: accept connections one after another, each a batch session
+int serve(Context *ctx, const char *path) {
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        report("socket path too long\n");
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        report("socket: %s\n", strerror(errno));
+        return 1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        report("cannot listen on '%s': %s\n", path, strerror(errno));
+        close(fd);
+        return 1;
+    }
+    // a client hanging up mid-answer shouldn't take the server down
+    signal(SIGPIPE, SIG_IGN);
+    for (;;) {
+        int conn = accept(fd, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR) continue;
+            report("accept: %s\n", strerror(errno));
+            break;
+        }
+        int out_fd = dup(conn);
+        FILE *in = fdopen(conn, "r");
+        FILE *out = out_fd >= 0 ? fdopen(out_fd, "w") : NULL;
+        if (in && out) run_batch(ctx, in, out);
+        if (in) fclose(in); else close(conn);
+        if (out) fclose(out); else if (out_fd >= 0) close(out_fd);
+    }
+    close(fd);
+    return 1;
+}
+
+// program text from argv, a file mapping, or a buffered stream
+typedef struct {
+    const char *data;
+    size_t len;
+    void *map;              // mmap'd file to unmap on close
+    size_t map_len;
+    char *buf;              // malloc'd stream contents to free on close
+} Source;
+
+#define SOURCE_CHUNK (64 * 1024)
+
+// read fd to EOF in SOURCE_CHUNK reads; for stdin and files that can't be mapped
+int source_read(Source *src, int fd) {
+    int cap = 0, len = 0;
+    char *buf = NULL;
+    for (;;) {
+        // the lexer takes an int length; stop before len + SOURCE_CHUNK overflows
+        if (len > INT_MAX - SOURCE_CHUNK) {
+            report("program too large\n");
+            free(buf);
+            return 0;
+        }
+        if (!grow_buf((void **)&buf, &cap, len + SOURCE_CHUNK, 1)) {
+            free(buf);
+            return 0;
+        }
+        ssize_t got = read(fd, buf + len, SOURCE_CHUNK);
+        if (got < 0) {
+            report("read: %s\n", strerror(errno));
+            free(buf);
+            return 0;
+        }
+        if (got == 0) break;
+        len += got;
+    }
+    *src = (Source){buf, (size_t)len, NULL, 0, buf};
+    return 1;
+}
+
+// map path read-only; the lexer works on the mapping directly, no copy
+int source_open(Source *src, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        report("cannot open '%s': %s\n", path, strerror(errno));
+        return 0;
+    }
+    struct stat sb;
+    int ok;
+    if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0) {
+        void *map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ok = map != MAP_FAILED;
+        if (ok) {
+            madvise(map, sb.st_size, MADV_SEQUENTIAL);
+            *src = (Source){map, (size_t)sb.st_size, map, (size_t)sb.st_size, NULL};
+        } else {
+            report("cannot map '%s': %s\n", path, strerror(errno));
+        }
+    } else {
+        // empty files, pipes and devices don't map
+        ok = source_read(src, fd);
+    }
+    close(fd);
+    return ok;
+}
+
+void source_close(Source *src) {
+    if (src->map) munmap(src->map, src->map_len);
+    free(src->buf);
+}
+
+void usage(void) {
+    fprintf(stderr, "usage: sheq4 [--mmap | --hugepages] [--vm [--gc | --gc-stats] | --parallel n | --memo | --memo-stats] "
+                    "[--profile | --profile-folded file] [--stats] "
+                    "('<expr>' | -f file | - | --load image | [--jobs n] (--batch | --framed) | --socket path)\n"
+                    "       sheq4 --compile-to image ('<expr>' | -f file | -)\n");
+}
+
+int main(int argc, char **argv) {
+    Options opts = {0};
+    const char *src = NULL;
+    const char *path = NULL;
+    int from_stdin = 0;
+
+    for (int i = 1; i < argc; i++) {
+        int have_src = src || path || from_stdin;
+        if (strcmp(argv[i], "--mmap") == 0) opts.arena_flags |= ARENA_MMAP;
+        else if (strcmp(argv[i], "--hugepages") == 0) opts.arena_flags |= ARENA_HUGE;
+        else if (strcmp(argv[i], "--vm") == 0) opts.use_vm = 1;
+        else if (strcmp(argv[i], "--gc") == 0) opts.gc = opts.gc > 1 ? opts.gc : 1;
+        else if (strcmp(argv[i], "--gc-stats") == 0) opts.gc = 2;
+        else if (strcmp(argv[i], "--memo") == 0) opts.memo = opts.memo > 1 ? opts.memo : 1;
+        else if (strcmp(argv[i], "--memo-stats") == 0) opts.memo = 2;
+        else if (strcmp(argv[i], "--profile") == 0) opts.profile = 1;
+        else if (strcmp(argv[i], "--profile-folded") == 0) {
+            if (i + 1 >= argc) { usage(); return 1; }
+            opts.profile_folded = argv[++i];
+            opts.profile = 1;
+        }
+        else if (strcmp(argv[i], "--stats") == 0) opts.stats = 1;
+        else if (strcmp(argv[i], "--batch") == 0) opts.batch = opts.batch ? opts.batch : BATCH_LINES;
+        else if (strcmp(argv[i], "--framed") == 0) opts.batch = BATCH_FRAMED;
+        else if (strcmp(argv[i], "--socket") == 0) {
+            if (i + 1 >= argc) { usage(); return 1; }
+            opts.socket_path = argv[++i];
+            opts.batch = opts.batch ? opts.batch : BATCH_LINES;
+        }
+        else if (strcmp(argv[i], "--compile-to") == 0) {
+            if (i + 1 >= argc) { usage(); return 1; }
+            opts.compile_to = argv[++i];
+        }
+        else if (strcmp(argv[i], "--load") == 0) {
+            if (i + 1 >= argc) { usage(); return 1; }
+            opts.load = argv[++i];
+        }
+        else if (strcmp(argv[i], "--jobs") == 0) {
+            if (i + 1 >= argc) { usage(); return 1; }
+            char *end;
+            long jobs = strtol(argv[++i], &end, 10);
+            if (*end || jobs < 1 || jobs > JOBS_MAX) {
+                report("--jobs takes 1 to %d\n", JOBS_MAX);
+                return 1;
+            }
+            opts.jobs = (int)jobs;
+        }
+        else if (strcmp(argv[i], "--parallel") == 0) {
+            if (i + 1 >= argc) { usage(); return 1; }
+            char *end;
+            long threads = strtol(argv[++i], &end, 10);
+            if (*end || threads < 1 || threads > JOBS_MAX) {
+                report("--parallel takes 1 to %d\n", JOBS_MAX);
+                return 1;
+            }
+            opts.parallel = (int)threads;
+        }
+        else if (argv[i][0] == '-' && argv[i][1] == '-') {
+            report("unknown option '%s'\n", argv[i]);
+            usage();
+            return 1;
+        }
+        else if (have_src) { usage(); return 1; }
+        else if (strcmp(argv[i], "-f") == 0) {
+            if (i + 1 >= argc) { usage(); return 1; }
+            path = argv[++i];
+        }
+        else if (strcmp(argv[i], "-") == 0) from_stdin = 1;
+        else src = argv[i];
+    }
+    int have_src = src || path || from_stdin;
+    if (have_src == (opts.batch || opts.load) || (opts.compile_to && (opts.batch || opts.load))) {
+        usage();
+        return 1;
+    }
+    if (opts.gc && !opts.use_vm) {
+        report("--gc needs --vm\n");
+        return 1;
+    }
+
+    if (opts.memo && opts.use_vm) {
+        report("--memo works on the tree walker, not --vm\n");
+        return 1;
+    }
+    if (opts.parallel && opts.use_vm) {
+        report("--parallel works on the tree walker, not --vm\n");
+        return 1;
+    }
+    if (opts.profile && (opts.use_vm || opts.parallel || opts.batch || opts.compile_to)) {
+        report("--profile runs one program on the tree walker, without --parallel\n");
+        return 1;
+    }
+    if (opts.jobs && (!opts.batch || opts.socket_path)) {
+        report("--jobs needs --batch or --framed\n");
+        return 1;
+    }
+    if (opts.jobs > 1) return run_batch_parallel(&opts, stdin, stdout);
+    if (opts.load) return run_image(opts.load, &opts);
+
+    if (opts.batch) {
+        Context ctx;
+        int status = 1;
+        if (context_init(&ctx, &opts)) {
+            if (opts.socket_path) {
+                status = serve(&ctx, opts.socket_path);
+            } else {
+                run_batch(&ctx, stdin, stdout);
+                status = 0;
+            }
+        }
+        context_destroy(&ctx);
+        return status;
+    }
+
+    Source source = {src, src ? strlen(src) : 0, NULL, 0, NULL};
+    if (path && !source_open(&source, path)) return 1;
+    if (from_stdin && !source_read(&source, STDIN_FILENO)) return 1;
+    int status;
+    if (source.len > INT_MAX) {
+        report("program too large\n");
+        status = 1;
+    } else if (opts.compile_to) {
+        status = compile_image(source.data, (int)source.len, &opts, opts.compile_to);
+    } else {
+        status = top_interp(source.data, (int)source.len, &opts);
     }
-    return top_interp(argv[1]);
+    source_close(&source);
+    return status;
 }
\ No newline at end of file
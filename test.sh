@@ -2,12 +2,30 @@
 
 pass=0
 fail=0
+# extra flags for every run, e.g. ENGINE=--vm to repeat the suite on the VM
+ENGINE=
 
 test_case() {
     name="$1"
     input="$2"
     expected="$3"
-    got=$(./sheq4 "$input" 2>/dev/null)
+    got=$(./sheq4 $ENGINE "$input" 2>/dev/null)
+    if [ "$got" = "$expected" ]; then
+        printf "%-40s OK\n" "$name"
+        ((pass++))
+    else
+        printf "%-40s FAIL (expected %s, got %s)\n" "$name" "$expected" "$got"
+        ((fail++))
+    fi
+}
+
+# same as test_case, with a command-line option before the program
+test_opt() {
+    name="$1"
+    opt="$2"
+    input="$3"
+    expected="$4"
+    got=$(./sheq4 $ENGINE "$opt" "$input" 2>/dev/null)
     if [ "$got" = "$expected" ]; then
         printf "%-40s OK\n" "$name"
         ((pass++))
@@ -20,7 +38,7 @@ test_case() {
 test_err() {
     name="$1"
     input="$2"
-    if ./sheq4 "$input" 2>&1 | grep -q "SHEQ"; then
+    if ./sheq4 $ENGINE "$input" 2>&1 | grep -q "SHEQ"; then
         printf "%-40s OK\n" "$name"
         ((pass++))
     else
@@ -29,49 +47,325 @@ test_err() {
     fi
 }
 
+# program on stdin via '-'
+test_stdin() {
+    name="$1"
+    input="$2"
+    expected="$3"
+    got=$(printf '%s' "$input" | ./sheq4 $ENGINE - 2>/dev/null)
+    if [ "$got" = "$expected" ]; then
+        printf "%-40s OK\n" "$name"
+        ((pass++))
+    else
+        printf "%-40s FAIL (expected %s, got %s)\n" "$name" "$expected" "$got"
+        ((fail++))
+    fi
+}
+
+# many programs through one process; expected is every result line
+test_batch() {
+    name="$1"
+    opt="$2"
+    input="$3"
+    expected="$4"
+    got=$(printf "$input" | ./sheq4 $ENGINE "$opt" 2>/dev/null)
+    if [ "$got" = "$expected" ]; then
+        printf "%-40s OK\n" "$name"
+        ((pass++))
+    else
+        printf "%-40s FAIL (expected %s, got %s)\n" "$name" "$expected" "$got"
+        ((fail++))
+    fi
+}
+
+# stderr of a run with opt matches the extended regex pattern
+test_report() {
+    name="$1"
+    opt="$2"
+    input="$3"
+    pattern="$4"
+    if ./sheq4 $ENGINE "$opt" "$input" 2>&1 >/dev/null | grep -Eq "$pattern"; then
+        printf "%-40s OK\n" "$name"
+        ((pass++))
+    else
+        printf "%-40s FAIL (expected %s on stderr)\n" "$name" "$pattern"
+        ((fail++))
+    fi
+}
+
+language_tests() {
+    test_case "number" "2" "2"
+    test_case "string" '"hello"' '"hello"'
+    test_case "true" "true" "true"
+    test_case "false" "false" "false"
+
+    test_case "add" "{+ 3 4}" "7"
+    test_case "sub" "{- 10 3}" "7"
+    test_case "mul" "{* 3 2}" "6"
+    test_case "div" "{/ 6 3}" "2"
+
+    test_case "lte true" "{<= 1 2}" "true"
+    test_case "lte false" "{<= 2 1}" "false"
+
+    test_case "equal? num" "{equal? 2 2}" "true"
+    test_case "equal? str" '{equal? "hi" "hi"}' "true"
+    test_case "equal? bool" "{equal? true false}" "false"
+
+    test_case "strlen" '{strlen "hello"}' "5"
+    test_case "substring" '{substring "hello" 0 2}' '"he"'
+    test_case "string-append" '{string-append "ab" "cd"}' '"abcd"'
+    test_case "string-append empty" '{string-append "" "x"}' '"x"'
+    test_err "string-append type error" '{string-append "a" 1}'
+
+    # string-append builds ropes and substring takes views; both must read back
+    # as plain strings
+    rope='{let {[rep = {lambda (self s n) : {if {<= n 0} s {self self {string-append s "0123456789"} {- n 1}}}}]} in {let {[big = {rep rep "" 20000}]} in '
+    test_case "rope length" "$rope{strlen big} end} end}" "200000"
+    test_case "rope substring across pieces" "$rope{substring big 99995 100012} end} end}" '"56789012345678901"'
+    test_case "rope equal? by content" "$rope{equal? {substring big 3 903} {substring big 103 1003}} end} end}" "true"
+    test_case "rope equals flat" '{equal? {string-append {string-append "abcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyz" "abcdefghijklmnopqrstuvwxyz"} "!"} "abcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyz!"}' "true"
+    test_case "view of view" '{substring {substring "hello world" 2 9} 1 4}' '"lo "'
+    test_case "appended views" '{string-append {substring "hello" 0 2} {substring "world" 3 5}}' '"held"'
+
+    test_case "if true" "{if true 1 2}" "1"
+    test_case "if false" "{if false 1 2}" "2"
+
+    test_case "lambda" "{{lambda (x) : {+ x 1}} 5}" "6"
+    test_case "lambda 2 params" "{{lambda (x y) : {+ x y}} 3 4}" "7"
+    test_case "nested lambda" "{{lambda (x) : {{lambda (y) : {+ x y}} 3}} 5}" "8"
+
+    test_case "let" "{let {[x = 5]} in {+ x 3} end}" "8"
+    test_case "let multi" "{let {[x = 5] [y = 3]} in {+ x y} end}" "8"
+
+    test_case "closure capture" "{{let {[x = 5]} in {lambda (y) : {+ x y}} end} 3}" "8"
+
+    test_case "higher-order" "{{lambda (f) : {f 5}} {lambda (x) : {+ x 1}}}" "6"
+    test_case "transitive capture" "{{{{lambda (a) : {lambda (b) : {lambda (c) : {+ a {+ b c}}}}} 1} 2} 3}" "6"
+    test_case "capture outlives frames" '{let {[adder = {lambda (n) : {lambda (x) : {+ x n}}}]} in {let {[f = {adder 10}] [g = {adder 20}]} in {+ {f 1} {g 2}} end} end}' "33"
+
+    # numbers print in the fewest digits that read back exactly; strings print whole
+    test_case "round-trip sum" "{+ 0.1 0.2}" "0.30000000000000004"
+    test_case "round-trip fraction" "{/ 22 7}" "3.142857142857143"
+    test_case "whole number" "{- 0 123456}" "-123456"
+    test_case "negative zero" "{* -1 0}" "-0"
+    long_string=$(printf 'x%.0s' $(seq 1 5000))
+    test_case "long string not truncated" "\"$long_string\"" "\"$long_string\""
+
+    # recursion deep enough to need more than one arena chunk
+    count_down='{let {[loop = {lambda (self n) : {if {<= n 0} 0 {+ 1 {self self {- n 1}}}}}]} in {loop loop 10000} end}'
+    test_case "arena grows past one chunk" "$count_down" "10000"
+    # call results that point into the call's scratch must survive reclamation
+    test_case "string result escapes call" '{{lambda (s) : {substring s 1 3}} "hello"}' '"el"'
+    test_case "closure result escapes call" "{{{lambda (x) : {lambda (y) : {* x y}}} 3} 4}" "12"
+    test_case "reclaimed calls in recursion" '{let {[fib = {lambda (self n) : {if {<= n 1} n {+ {self self {- n 1}} {self self {- n 2}}}}}]} in {fib fib 15} end}' "610"
+
+    # tail calls run in constant C stack and constant arena
+    test_case "tail call loop" '{let {[loop = {lambda (self n acc) : {if {<= n 0} acc {self self {- n 1} {+ acc 1}}}}]} in {loop loop 300000 0} end}' "300000"
+    test_case "mutual tail calls" '{let {[even = {lambda (e o n) : {if {<= n 0} true {o e o {- n 1}}}}] [odd = {lambda (e o n) : {if {<= n 0} false {e e o {- n 1}}}}]} in {even even odd 100001} end}' "false"
+    test_case "tail call with escaping arg" '{let {[loop = {lambda (self n f) : {if {<= n 0} {f 1} {self self {- n 1} {lambda (x) : {+ x n}}}}}]} in {loop loop 1000 {lambda (x) : x}} end}' "2"
+
+    # constant folding and inlined primitives keep runtime semantics
+    test_case "folded nested arithmetic" "{+ 1 {* 2 3}}" "7"
+    test_case "folded substring" '{strlen {substring "hello" 1 4}}' "3"
+    test_case "folded if" "{if {<= 1 2} 10 20}" "10"
+    test_case "error in untaken branch" "{if false {/ 1 0} 2}" "2"
+    test_case "shadowed primitive" "{{lambda (+) : {+ 1 2}} {lambda (a b) : {* a b}}}" "2"
+    test_case "inline equal? mixed" '{{lambda (x) : {equal? x 1}} "a"}' "false"
+    test_case "inline strlen" '{{lambda (s) : {strlen s}} "abcd"}' "4"
+    test_err "inline add type error" '{{lambda (x) : {+ x 1}} "a"}'
+    test_err "prim arity error" "{+ 1}"
+
+    # enough distinct names to force the intern table to rehash
+    many_names="{let {"
+    for i in $(seq 1 300); do many_names+="[v$i = $i] "; done
+    many_names+="} in {+ v1 v300} end}"
+    test_case "intern table growth" "$many_names" "301"
+
+    test_err "div by zero" "{/ 5 0}"
+    test_err "user error" '{error "fail"}'
+    test_err "arity mismatch" "{{lambda (x) : x} 1 2}"
+    test_err "apply non-func" "{1 2}"
+    test_err "if non-bool" "{if 1 2 3}"
+    test_err "unbound" "x"
+    test_err "unbound in untaken branch" "{if true 1 y}"
+    test_err "unbound inside lambda body" "{lambda (x) : {+ x z}}"
+    test_err "duplicate param" "{lambda (x x) : x}"
+    test_err "bad char after expr" "{+ 1 2} @"
+    test_err "unterminated string" '{strlen "abc}'
+}
+
 echo "SHEQ4 tests"
 echo ""
+language_tests
 
-test_case "number" "2" "2"
-test_case "string" '"hello"' '"hello"'
-test_case "true" "true" "true"
-test_case "false" "false" "false"
-
-test_case "add" "{+ 3 4}" "7"
-test_case "sub" "{- 10 3}" "7"
-test_case "mul" "{* 3 2}" "6"
-test_case "div" "{/ 6 3}" "2"
+echo ""
+echo "--vm"
+ENGINE=--vm
+language_tests
+# superinstructions fall back to the primitive for non-numbers
+test_err "vm add local non-number" '{{lambda (x) : {+ x 1}} "a"}'
+test_err "vm branch lte non-number" '{{lambda (n) : {if {<= n 1} 1 2}} "s"}'
+test_err "vm inline div by zero" "{{lambda (x) : {/ x 0}} 5}"
+ENGINE=
 
-test_case "lte true" "{<= 1 2}" "true"
-test_case "lte false" "{<= 2 1}" "false"
+echo ""
+echo "--parallel"
+ENGINE="--parallel 2"
+language_tests
+fib='{let {[fib = {lambda (self n) : {if {<= n 1} n {+ {self self {- n 1}} {self self {- n 2}}}}}]} in {fib fib 20} end}'
+test_case "parallel fib" "$fib" "6765"
+test_case "parallel string results" '{let {[f = {lambda (n) : {substring "hello" 0 n}}]} in {{lambda (a b) : {+ {strlen a} {strlen b}}} {f 2} {f 3}} end}' "5"
+test_case "parallel closure results" '{let {[f = {lambda (n) : {lambda (x) : {+ x n}}}]} in {{lambda (a b) : {+ {a 1} {b 2}}} {f 10} {f 20}} end}' "33"
+test_err "parallel forked error" '{let {[f = {lambda (n) : {/ 1 n}}]} in {+ {f 0} {f 1}} end}'
+ENGINE="--vm --parallel 2"
+test_err "parallel needs tree walker" "1"
+ENGINE=
 
-test_case "equal? num" "{equal? 2 2}" "true"
-test_case "equal? str" '{equal? "hi" "hi"}' "true"
-test_case "equal? bool" "{equal? true false}" "false"
+echo ""
+echo "--memo"
+ENGINE=--memo
+language_tests
+# exponential without the table; tail loops stay loops
+test_case "memo fib 90" '{let {[fib = {lambda (self n) : {if {<= n 1} n {+ {self self {- n 1}} {self self {- n 2}}}}}]} in {fib fib 90} end}' "2.880067194370816e+18"
+test_case "memo tail loop" '{let {[loop = {lambda (self n) : {if {<= n 0} 7 {self self {- n 1}}}}]} in {loop loop 1000000} end}' "7"
+test_case "memo string keys" '{let {[f = {lambda (s) : {strlen s}}]} in {+ {f {substring "abcd" 0 2}} {f "ab"}} end}' "4"
+test_case "memo closure results" '{let {[f = {lambda (n) : {lambda (x) : {+ x n}}}]} in {{lambda (a b) : {+ {a 1} {b 2}}} {f 10} {f 20}} end}' "33"
+# -0 and 0 are different keys, or the cached result would change what prints
+test_case "memo keeps -0 apart from 0" '{let {[f = {lambda (x) : {* x 1}}]} in {let {[a = {f 0}] [b = {f -0}]} in b end} end}' "-0"
+test_err "memo keeps errors" '{let {[f = {lambda (n) : {/ 1 n}}]} in {{lambda (a b) : a} 1 {f 0}} end}'
+ENGINE="--vm --memo"
+test_err "memo needs tree walker" "1"
+ENGINE=
 
-test_case "strlen" '{strlen "hello"}' "5"
-test_case "substring" '{substring "hello" 0 2}' '"he"'
+echo ""
+echo "--profile"
+ENGINE=--profile
+language_tests
+ENGINE=
+fib_calls='{let {[fib = {lambda (self n) : {if {<= n 1} n {+ {self self {- n 1}} {self self {- n 2}}}}}]} in {fib fib 20} end}'
+test_report "profile counts calls" "--profile" "$fib_calls" '^ +21891 .* lambda@1:15$'
+test_report "profile counts nodes" "--profile" "$fib_calls" 'IfC 21891 '
+test_report "profile counts prims" "--profile" "$fib_calls" 'prims: +<= 21891 '
+test_report "profile counts bytes" "--profile" '{{lambda (s) : {substring s 0 2}} "hello"}' ', [1-9][0-9]* bytes allocated'
+# each iteration replaces the last activation; the C stack stays flat
+tail_loop='{let {[loop = {lambda (self n) : {if {<= n 0} 7 {self self {- n 1}}}}]} in {loop loop 1000000} end}'
+test_opt "profile tail loop" "--profile" "$tail_loop" "7"
+test_report "profile counts tail calls" "--profile" "$tail_loop" '^ +1000001 .* lambda@1:16$'
+ENGINE=--memo
+test_report "profile with memo" "--profile" '{let {[fib = {lambda (self n) : {if {<= n 1} n {+ {self self {- n 1}} {self self {- n 2}}}}}]} in {fib fib 90} end}' '^ +179 .* lambda@1:15$'
+ENGINE=
+ENGINE="--vm --profile"
+test_err "profile needs tree walker" "1"
+ENGINE=
 
-test_case "if true" "{if true 1 2}" "1"
-test_case "if false" "{if false 1 2}" "2"
+echo ""
+echo "--stats"
+ENGINE=--stats
+language_tests
+ENGINE=
+test_report "stats counts tokens" "--stats" '{+ 1 2}' ' 5 tokens, largest AST '
+test_report "stats counts frames" "--stats" "$fib_calls" '^ +env +[1-9][0-9]* bytes +[1-9][0-9]* allocations$'
+test_report "stats counts strings" "--stats" '{{lambda (s) : {string-append s "!"}} "hello"}' '^ +string +[1-9][0-9]* bytes'
+test_report "stats high water" "--stats" "$tail_loop" 'high water [0-9]{2,3}, '
+ENGINE=--vm
+test_report "stats counts bytecode" "--stats" "$fib_calls" '^ +code +[1-9][0-9]* bytes'
+ENGINE=--memo
+test_report "stats counts memo arena" "--stats" "$fib_calls" '^  memo: [1-9][0-9]* bytes'
+ENGINE=
+if printf '{+ 1 2}\n{* 2 3}\n' | ./sheq4 --stats --batch 2>&1 >/dev/null | grep -q '^SHEQ: stats: 2 programs,'; then
+    printf "%-40s OK\n" "stats report for batch"
+    ((pass++))
+else
+    printf "%-40s FAIL\n" "stats report for batch"
+    ((fail++))
+fi
 
-test_case "lambda" "{{lambda (x) : {+ x 1}} 5}" "6"
-test_case "lambda 2 params" "{{lambda (x y) : {+ x y}} 3 4}" "7"
-test_case "nested lambda" "{{lambda (x) : {{lambda (y) : {+ x y}} 3}} 5}" "8"
+echo ""
+test_opt "mmap arena" "--mmap" "$count_down" "10000"
+test_opt "hugepage arena" "--hugepages" "$count_down" "10000"
 
-test_case "let" "{let {[x = 5]} in {+ x 3} end}" "8"
-test_case "let multi" "{let {[x = 5] [y = 3]} in {+ x y} end}" "8"
+# enough garbage to force several collections, then live data that must survive one
+ENGINE=--vm
+string_churn='{let {[loop = {lambda (self n s) : {if {<= n 0} s {self self {- n 1} {substring "abcdefgh" 1 {- 5 {* 0 n}}}}}}]} in {loop loop 400000 "x"} end}'
+closure_chain='{let {[loop = {lambda (self n f) : {if {<= n 0} {f 1} {self self {- n 1} {lambda (x) : {+ {f x} 1}}}}}]} in {loop loop 200000 {lambda (x) : x}} end}'
+test_opt "gc string churn" "--gc" "$string_churn" '"bcde"'
+test_opt "gc keeps live closures" "--gc" "$closure_chain" "200001"
+test_opt "gc recursion" "--gc" '{let {[fib = {lambda (self n) : {if {<= n 1} n {+ {self self {- n 1}} {self self {- n 2}}}}}]} in {fib fib 20} end}' "6765"
+ENGINE=--gc
+test_err "gc needs vm" "1"
+ENGINE=
 
-test_case "closure capture" "{{let {[x = 5]} in {lambda (y) : {+ x y}} end} 3}" "8"
+# source files are mapped, stdin is read in chunks; both handle more than argv can
+src_file=$(mktemp)
+img_file=$(mktemp)
+trap 'rm -f "$src_file" "$img_file"' EXIT
+printf '{let {[f = {lambda (x) :\n    {* x 2}}]}\n in {f 21} end}' > "$src_file"
+test_opt "file input" "-f" "$src_file" "42"
+big_program="{let {"
+for i in $(seq 1 20000); do big_program+="[v$i = $i] "; done
+big_program+="} in {+ v1 v20000} end}"
+printf '%s' "$big_program" > "$src_file"
+test_opt "large file input" "-f" "$src_file" "20001"
+test_stdin "stdin input" "{+ 1 {* 2 3}}" "7"
+test_stdin "large stdin input" "$big_program" "20001"
 
-test_case "higher-order" "{{lambda (f) : {f 5}} {lambda (x) : {+ x 1}}}" "6"
+# an image holds the resolved, optimized program; every engine runs it as is
+fib_program='{let {[fib = {lambda (self n) : {if {<= n 1} n {+ {self self {- n 1}} {self self {- n 2}}}}}]} in {fib fib 20} end}'
+./sheq4 --compile-to "$img_file" "$fib_program"
+test_opt "load image" "--load" "$img_file" "6765"
+ENGINE=--vm
+test_opt "load image on vm" "--load" "$img_file" "6765"
+ENGINE="--parallel 2"
+test_opt "load image in parallel" "--load" "$img_file" "6765"
+ENGINE=--profile
+test_report "profile loaded image" "--load" "$img_file" '^ +21891 .* lambda@1:15$'
+ENGINE=
+fold_file="$src_file.folded"
+# the let's lambda tail-calls fib, so fib's activations sit right under the top level
+./sheq4 --profile-folded "$fold_file" "$fib_program" >/dev/null 2>&1
+if grep -Eq '^<top>;lambda@1:15;lambda@1:15 [0-9]+$' "$fold_file"; then
+    printf "%-40s OK\n" "profile folded stacks"
+    ((pass++))
+else
+    printf "%-40s FAIL\n" "profile folded stacks"
+    ((fail++))
+fi
+rm -f "$fold_file"
+./sheq4 --compile-to "$img_file" '{string-append {substring "hello world" 0 5} {string-append "! " "abcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyz"}}'
+test_opt "image keeps folded strings" "--load" "$img_file" '"hello! abcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyz"'
+ENGINE="--compile-to $img_file"
+test_err "compile unbound" "{f 1}"
+ENGINE=--load
+test_err "load non-image" "$src_file"
+head -c 64 "$img_file" > "$src_file"
+test_err "load truncated image" "$src_file"
+# point the root StrC's literal index (after the 64-byte header, 4 bytes into the node) past the table
+./sheq4 --compile-to "$img_file" '"hi"'
+printf '\xff\xff\xff\xff' | dd of="$img_file" bs=1 seek=68 conv=notrunc 2>/dev/null
+test_err "load image with bad index" "$img_file"
+# nums (2 x 8 bytes), then 5 nodes (16 bytes each), then kids: make the call's last arg share node 2
+./sheq4 --compile-to "$img_file" '{{lambda (a b) : a} 1 2}'
+printf '\x02' | dd of="$img_file" bs=1 seek=168 conv=notrunc 2>/dev/null
+test_err "load image with shared node" "$img_file"
+ENGINE=
 
-test_err "div by zero" "{/ 5 0}"
-test_err "user error" '{error "fail"}'
-test_err "arity mismatch" "{{lambda (x) : x} 1 2}"
-test_err "apply non-func" "{1 2}"
-test_err "if non-bool" "{if 1 2 3}"
-test_err "unbound" "x"
+# one result line per program; errors stay on their own line and later programs still run
+batch_expected=$'3\nSHEQ: division by zero\n"ab"\nSHEQ: unbound: f\n5'
+batch_input='{+ 1 2}\n{/ 1 0}\n{substring "abc" 0 2}\n{f 1}\n{{lambda (x) : x} 5}\n'
+test_batch "batch lines" "--batch" "$batch_input" "$batch_expected"
+test_batch "batch framed" "--framed" '7\n{+ 1 2}8\n{+ 1\n 2}' $'3\n3'
+test_batch "batch bad frame" "--framed" '7\n{+ 1 2}x\n' $'3\nSHEQ: malformed frame'
+ENGINE="--jobs 4"
+test_batch "batch on worker threads" "--batch" "$batch_input" "$batch_expected"
+test_batch "batch bad frame on workers" "--framed" '7\n{+ 1 2}x\n' $'3\nSHEQ: malformed frame'
+many_input=$(for i in $(seq 1 2000); do printf '{* %d 2}\\n' $i; done)
+many_expected=$(for i in $(seq 1 2000); do echo $((i * 2)); done)
+test_batch "workers keep input order" "--batch" "$many_input" "$many_expected"
+ENGINE=--vm
+test_batch "batch lines on vm" "--batch" "$batch_input" "$batch_expected"
+ENGINE="--vm --gc"
+test_batch "batch reuses gc heap" "--batch" "$string_churn\n$string_churn\n" $'"bcde"\n"bcde"'
+ENGINE=
 
 echo ""
 echo "done: $pass passed, $fail failed"
\ No newline at end of file